@@ -0,0 +1,74 @@
+#!/bin/sh
+# Times parsing generated flat scripts of growing size and writes one JSON
+# report. The time per statement should stay about the same as they grow;
+# the script fails when the largest costs more than twice the smallest.
+# usage: bench/parse.sh [interpreter] [output.json] [interpreter options...]
+
+EXE=${1:-build/run}
+OUTPUT=${2:-build/parse.json}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+OPTIONS="$*"
+
+SIZES="125000 250000 500000 1000000"
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+# What a code generator emits: assignments, calls and a few small blocks, in one long flat script
+generate() {
+    awk -v n=$1 'BEGIN {
+        print "function f(a, b) {"
+        print "    return a * 2 + b;"
+        print "}"
+        print "a = 1;"
+        print "b = 2;"
+        for (i = 0; i < n; i++) {
+            if (i % 100 == 99)
+                print "if (a > b) { a = a - b; } else { b = b - a + 1; }"
+            else if (i % 3 == 0)
+                print "a = f(a, " i % 13 ") / 3;"
+            else if (i % 3 == 1)
+                print "b = (b + a) / 3 + " i % 7 ";"
+            else
+                print "c = a * b - " i % 11 ";"
+        }
+        print "print a + b;"
+    }' > "$2"
+}
+
+{
+    printf '{"interpreter": "%s", "options": "%s", "parse": [' "$EXE" "$OPTIONS"
+    separator=""
+    for n in $SIZES; do
+        generate $n "$TMP_DIR/flat.my"
+        "$EXE" --bench $OPTIONS "$TMP_DIR/flat.my" >/dev/null 2>"$TMP_DIR/stderr"
+        report=$(tail -n 1 "$TMP_DIR/stderr")
+        printf '%s\n  ' "$separator"
+        echo "$report" | awk -v n=$n '{
+            gsub(/[{}",:]/, " ")
+            for (i = 1; i < NF; i += 2)
+                value[$i] = $(i + 1)
+            printf "{\"statements\": %d, \"parse_seconds\": %s, \"ns_per_statement\": %.1f, \"peak_rss_kb\": %d}",
+                n, value["parse_seconds"], value["parse_seconds"] * 1e9 / n, value["peak_rss_kb"]
+        }'
+        separator=","
+        echo "$n" >&2
+    done
+    printf '\n]}\n'
+} > "$OUTPUT"
+
+# Linear when the cost per statement of the largest is within 2x of the smallest
+awk '
+    /"ns_per_statement"/ {
+        sub(/.*"ns_per_statement": /, "")
+        sub(/,.*/, "")
+        if (!sizes++)
+            first = $0 + 0
+        last = $0 + 0
+    }
+    END {
+        if (!sizes || last > 2 * first) {
+            print "parse time grows faster than the script: " first " ns then " last " ns per statement" > "/dev/stderr"
+            exit 1
+        }
+    }' "$OUTPUT"
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Runs every bench/*.my script, plus a generated straight-line one, and writes
+# one JSON report with the timings and counts printed by `--bench`.
+# usage: bench/run.sh [interpreter] [output.json] [interpreter options...]
+
+BENCH_DIR=$(dirname "$0")
+EXE=${1:-build/run}
+OUTPUT=${2:-build/bench.json}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+OPTIONS="$*"
+
+# Straight-line code: a long script with no loops or calls, mostly parsing
+STRAIGHT_LINES=20000
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+awk -v n=$STRAIGHT_LINES 'BEGIN {
+    print "a = 1;"
+    print "b = 2;"
+    for (i = 0; i < n; i++) {
+        if (i % 2 == 0)
+            print "a = a + b * " i % 13 " - 1;"
+        else
+            print "b = (b + a) / 3 + " i % 7 ";"
+    }
+    print "print a + b;"
+}' > "$TMP_DIR/straight.my"
+
+{
+    printf '{"interpreter": "%s", "options": "%s", "benchmarks": [' "$EXE" "$OPTIONS"
+    separator=""
+    for script in "$BENCH_DIR"/*.my "$TMP_DIR/straight.my"; do
+        name=$(basename "$script" .my)
+        # The report is the last line on stderr; program output is discarded
+        "$EXE" --bench $OPTIONS "$script" >/dev/null 2>"$TMP_DIR/stderr"
+        status=$?
+        report=$(tail -n 1 "$TMP_DIR/stderr")
+        printf '%s\n  ' "$separator"
+        case "$report" in
+        "{\"statements\""*)
+            echo "$report" | awk -v name="$name" '{
+                gsub(/[{}",:]/, " ")
+                for (i = 1; i < NF; i += 2)
+                    value[$i] = $(i + 1)
+                printf "{\"name\": \"%s\", \"statements\": %d, \"calls\": %d, \"parse_seconds\": %s, \"run_seconds\": %s, ", name, value["statements"], value["calls"], value["parse_seconds"], value["run_seconds"]
+                printf "\"statements_per_second\": %.0f, ", (value["parse_seconds"] > 0 ? value["statements"] / value["parse_seconds"] : 0)
+                printf "\"calls_per_second\": %.0f, ", (value["run_seconds"] > 0 ? value["calls"] / value["run_seconds"] : 0)
+                printf "\"peak_rss_kb\": %d}", value["peak_rss_kb"]
+            }'
+            ;;
+        *)
+            printf '{"name": "%s", "error": "no report, exit status %s"}' "$name" "$status"
+            ;;
+        esac
+        separator=","
+        echo "$name" >&2
+    done
+    printf '\n]}\n'
+} > "$OUTPUT"
+
+echo "wrote $OUTPUT" >&2
@@ -0,0 +1,73 @@
+#include "arena.hpp"
+#include <new>
+#include <stdlib.h>
+
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 8
+
+
+// Parsing and optimizing happen on several threads, each into its own program
+thread_local Arena *Arena::current = NULL;
+
+
+Arena::Scope::Scope(Arena *arena) : previous(current) {
+    current = arena;
+}
+
+Arena::Scope::~Scope() {
+    current = previous;
+}
+
+
+Arena::Arena() : used(ARENA_BLOCK_SIZE), bytes(0) {}
+
+Arena::~Arena() {
+    for (vector<pair<void *, Destroy> >::iterator iter = owners.begin(); iter != owners.end(); iter++) {
+        iter->second(iter->first);
+    }
+    for (vector<char *>::iterator iter = blocks.begin(); iter != blocks.end(); iter++) {
+        free(*iter);
+    }
+}
+
+
+void *Arena::allocate(size_t size, Destroy destroy) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    void *node;
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        // A long string or array gets a block of its own, slipped in before the one being filled
+        node = malloc(size);
+        if (!node)
+            throw bad_alloc();
+        blocks.insert(blocks.end() - (blocks.empty() ? 0 : 1), (char *)node);
+    } else {
+        if (used + size > ARENA_BLOCK_SIZE) {
+            char *block = (char *)malloc(ARENA_BLOCK_SIZE);
+            if (!block)
+                throw bad_alloc();
+            blocks.push_back(block);
+            used = 0;
+        }
+        node = blocks.back() + used;
+        used += size;
+    }
+    bytes += size;
+    if (destroy)
+        owners.push_back(make_pair(node, destroy));
+    return node;
+}
+
+
+size_t Arena::getBytes() const {
+    return bytes;
+}
+
+
+void *Arena::allocateNode(size_t size, Destroy destroy) {
+    return current ? current->allocate(size, destroy) : ::operator new(size);
+}
+
+Arena *Arena::inScope() {
+    return current;
+}
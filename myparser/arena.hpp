@@ -0,0 +1,55 @@
+#ifndef H_ARENA
+#define H_ARENA
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+
+// Where the syntax tree of one program lives, and the strings of its literals
+// or of a run. Nodes are carved one after another out of large blocks, so a
+// tree lies in a few contiguous runs in the order it was built, and all of it
+// is freed at once with the arena. Only the nodes that own memory of their
+// own register a destructor to run first.
+class Arena {
+public:
+    typedef void (*Destroy)(void *);
+
+    template <class T>
+    static void destroy(void *node) {
+        static_cast<T *>(node)->~T();
+    }
+
+    // Sends the nodes built on this thread to an arena for as long as it lives
+    class Scope {
+    private:
+        Arena *previous;
+    public:
+        Scope(Arena *arena);
+        ~Scope();
+    };
+
+    Arena();
+    ~Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, Destroy destroy);
+    size_t getBytes() const;
+
+    // From the arena in scope. A node built outside of any is never freed.
+    static void *allocateNode(size_t size, Destroy destroy);
+    static Arena *inScope();
+
+private:
+    vector<char *> blocks;
+    size_t used;                        // of the last block
+    size_t bytes;                       // handed out
+    vector<pair<void *, Destroy> > owners;
+
+    static thread_local Arena *current;
+};
+
+
+#endif /* H_ARENA */
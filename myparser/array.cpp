@@ -0,0 +1,221 @@
+#include "array.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+#include <sstream>
+
+
+// One operand of an element-wise operation, read ARRAY_CHUNK elements at a
+// time as T: an array of T in place, an int array converted, or a number repeated.
+template <class T>
+class Elements {
+private:
+    const MyArray *array;               // NULL for a number, which fills the buffer once
+    T buffer[ARRAY_CHUNK];
+
+public:
+    Elements(MyObject value) : array(value.isArray() ? value.getArray() : NULL) {
+        if (!array) {
+            T number = value.isInt() ? (T)value.getInt() : (T)value.getDouble();
+            for (size_t i = 0; i < ARRAY_CHUNK; i++)
+                buffer[i] = number;
+        }
+    }
+
+    // The n elements from begin on, n at most ARRAY_CHUNK
+    const T *at(size_t begin, size_t n) {
+        if (!array)
+            return buffer;
+        if ((array->type == ARRAY_DOUBLE) == (sizeof(T) == sizeof(double)))
+            return (const T *)array->data + begin;
+        const int32_t *ints = array->ints() + begin;
+        for (size_t i = 0; i < n; i++)
+            buffer[i] = ints[i];
+        return buffer;
+    }
+};
+
+
+static bool hasDoubles(MyObject value) {
+    return value.isArray() ? value.getArray()->type == ARRAY_DOUBLE : value.isDouble();
+}
+
+static StringException typeError(const char *what, MyObject value) {
+    return StringException(string("Type error: ") + what + " of " + value.typeName());
+}
+
+static const MyArray *arrayArgument(const char *what, MyObject value) {
+    if (!value.isArray())
+        throw typeError(what, value);
+    return value.getArray();
+}
+
+static MyObject element(const MyArray *array, size_t i) {
+    return array->type == ARRAY_INT ? MyObject(array->ints()[i]) : MyObject::fromDouble(array->doubles()[i]);
+}
+
+
+// Neither side is a string by now: the operators of object.cpp deal with those first
+MyObject arrayBinary(int op, MyObject left, MyObject right) {
+    const MyArray *a = left.isArray() ? left.getArray() : NULL;
+    const MyArray *b = right.isArray() ? right.getArray() : NULL;
+    if (a && b && a->length != b->length) {
+        stringstream ss;
+        ss << "Array lengths differ: " << a->length << " and " << b->length;
+        throw StringException(ss.str());
+    }
+    size_t length = a ? a->length : b->length;
+    const Kernels &k = kernels();
+
+    if (!hasDoubles(left) && !hasDoubles(right)) {
+        if (op == KERNEL_DIV) {
+            bool zero = b ? find(b->ints(), b->ints() + length, 0) != b->ints() + length : right.getInt() == 0;
+            if (zero)
+                throw StringException("Division by zero");
+        }
+        MyArray *result = MyArray::make(ARRAY_INT, length);
+        Elements<int32_t> l(left), r(right);
+        for (size_t i = 0; i < length; i += ARRAY_CHUNK) {
+            size_t n = min(length - i, (size_t)ARRAY_CHUNK);
+            k.ints[op](l.at(i, n), r.at(i, n), result->ints() + i, n);
+        }
+        return MyObject::fromArray(result);
+    }
+
+    MyArray *result = MyArray::make(op < KERNEL_GT ? ARRAY_DOUBLE : ARRAY_INT, length);
+    Elements<double> l(left), r(right);
+    for (size_t i = 0; i < length; i += ARRAY_CHUNK) {
+        size_t n = min(length - i, (size_t)ARRAY_CHUNK);
+        if (op < KERNEL_GT)
+            k.doubles[op](l.at(i, n), r.at(i, n), result->doubles() + i, n);
+        else
+            k.doubleCompares[op - KERNEL_GT](l.at(i, n), r.at(i, n), result->ints() + i, n);
+    }
+    return MyObject::fromArray(result);
+}
+
+
+// Ints only make an int array; a single double makes them all doubles
+MyObject arrayLiteral(const MyObject *args, int nargs) {
+    bool doubles = false;
+    for (int i = 0; i < nargs; i++) {
+        if (!args[i].isNumber())
+            throw typeError("array", args[i]);
+        doubles = doubles || args[i].isDouble();
+    }
+    MyArray *array = MyArray::make(doubles ? ARRAY_DOUBLE : ARRAY_INT, nargs);
+    for (int i = 0; i < nargs; i++) {
+        if (doubles)
+            array->doubles()[i] = args[i].toDouble();
+        else
+            array->ints()[i] = args[i].getInt();
+    }
+    return MyObject::fromArray(array);
+}
+
+
+static size_t sequenceLength(const char *what, MyObject value) {
+    if (value.isArray())
+        return value.getArray()->length;
+    if (value.isString())
+        return value.getString()->length;
+    throw typeError(what, value);
+}
+
+// Counts from the end when negative
+MyObject arrayIndex(const MyObject *args, int nargs) {
+    size_t length = sequenceLength("index", args[0]);
+    if (!args[1].isInt())
+        throw typeError("index", args[1]);
+    long long i = args[1].getInt();
+    if (i < 0)
+        i += length;
+    if (i < 0 || i >= (long long)length) {
+        stringstream ss;
+        ss << "Index " << args[1].getInt() << " out of range for length " << length;
+        throw StringException(ss.str());
+    }
+    if (args[0].isString())
+        return MyObject::fromString(MyString::make(args[0].getString()->chars + i, 1));
+    return element(args[0].getArray(), i);
+}
+
+static size_t clampIndex(MyObject index, size_t length) {
+    if (!index.isInt())
+        throw typeError("slice", index);
+    long long i = index.getInt();
+    if (i < 0)
+        i += length;
+    return i < 0 ? 0 : min((size_t)i, length);
+}
+
+// A slice of an array shares its elements; one of a string has to copy them
+MyObject arraySlice(const MyObject *args, int nargs) {
+    size_t length = sequenceLength("slice", args[0]);
+    size_t begin = clampIndex(args[1], length);
+    size_t end = max(begin, clampIndex(args[2], length));
+    if (args[0].isString())
+        return MyObject::fromString(MyString::make(args[0].getString()->chars + begin, end - begin));
+    return MyObject::fromArray(MyArray::slice(args[0].getArray(), begin, end));
+}
+
+MyObject arrayLength(const MyObject *args, int nargs) {
+    return (int)sequenceLength("len", args[0]);
+}
+
+
+MyObject arraySum(const MyObject *args, int nargs) {
+    const MyArray *array = arrayArgument("sum", args[0]);
+    if (array->type == ARRAY_INT)
+        return kernels().sumInts(array->ints(), array->length);
+    return MyObject::fromDouble(kernels().sumDoubles(array->doubles(), array->length));
+}
+
+MyObject arrayMin(const MyObject *args, int nargs) {
+    const MyArray *array = arrayArgument("min", args[0]);
+    if (array->length == 0)
+        throw StringException("min of an empty array");
+    if (array->type == ARRAY_INT)
+        return kernels().minInts(array->ints(), array->length);
+    return MyObject::fromDouble(kernels().minDoubles(array->doubles(), array->length));
+}
+
+MyObject arrayMax(const MyObject *args, int nargs) {
+    const MyArray *array = arrayArgument("max", args[0]);
+    if (array->length == 0)
+        throw StringException("max of an empty array");
+    if (array->type == ARRAY_INT)
+        return kernels().maxInts(array->ints(), array->length);
+    return MyObject::fromDouble(kernels().maxDoubles(array->doubles(), array->length));
+}
+
+MyObject arrayDot(const MyObject *args, int nargs) {
+    const MyArray *a = arrayArgument("dot", args[0]);
+    const MyArray *b = arrayArgument("dot", args[1]);
+    if (a->length != b->length) {
+        stringstream ss;
+        ss << "Array lengths differ: " << a->length << " and " << b->length;
+        throw StringException(ss.str());
+    }
+    if (a->type == ARRAY_INT && b->type == ARRAY_INT)
+        return kernels().dotInts(a->ints(), b->ints(), a->length);
+    if (a->type == ARRAY_DOUBLE && b->type == ARRAY_DOUBLE)
+        return MyObject::fromDouble(kernels().dotDoubles(a->doubles(), b->doubles(), a->length));
+    Elements<double> l(args[0]), r(args[1]);
+    double dot = 0;
+    for (size_t i = 0; i < a->length; i += ARRAY_CHUNK) {
+        size_t n = min(a->length - i, (size_t)ARRAY_CHUNK);
+        dot += kernels().dotDoubles(l.at(i, n), r.at(i, n), n);
+    }
+    return MyObject::fromDouble(dot);
+}
+
+
+MyObject arrayRange(const MyObject *args, int nargs) {
+    if (!args[0].isInt())
+        throw typeError("range", args[0]);
+    size_t length = max(args[0].getInt(), 0);
+    MyArray *array = MyArray::make(ARRAY_INT, length);
+    for (size_t i = 0; i < length; i++)
+        array->ints()[i] = i;
+    return MyObject::fromArray(array);
+}
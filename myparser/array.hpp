@@ -0,0 +1,32 @@
+#ifndef H_ARRAY
+#define H_ARRAY
+
+#include "kernels.hpp"
+#include "object.hpp"
+using namespace std;
+
+
+// Elements the kernels are run over at a time when an operand has to be
+// converted or repeated first, so that the buffer stays on the stack
+#define ARRAY_CHUNK 256
+
+
+// left op right with an array on at least one side, op a KernelOp. Two arrays
+// must have the same length; a number on the other side applies to every
+// element. Arithmetic gives doubles if either side has them, and comparisons
+// an int array of 0 and 1.
+MyObject arrayBinary(int op, MyObject left, MyObject right);
+
+// What the natives of library.cpp do with arrays. Each takes its arguments in order.
+MyObject arrayLiteral(const MyObject *args, int nargs);    // [a, b, ...]
+MyObject arrayIndex(const MyObject *args, int nargs);      // a[i], negative from the end
+MyObject arraySlice(const MyObject *args, int nargs);      // a[begin:end], clamped to the bounds
+MyObject arrayLength(const MyObject *args, int nargs);
+MyObject arraySum(const MyObject *args, int nargs);
+MyObject arrayMin(const MyObject *args, int nargs);
+MyObject arrayMax(const MyObject *args, int nargs);
+MyObject arrayDot(const MyObject *args, int nargs);
+MyObject arrayRange(const MyObject *args, int nargs);      // [0, 1, ..., n - 1]
+
+
+#endif /* H_ARRAY */
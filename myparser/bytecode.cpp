@@ -0,0 +1,108 @@
+#include "bytecode.hpp"
+#include "memo.hpp"
+#include "natives.hpp"
+#include <sstream>
+
+
+#define OPCODE_INFO(name, a, b, c) {#name, a, b, c},
+const OpcodeInfo opcodeInfo[OP_COUNT] = {
+    OPCODES(OPCODE_INFO)
+};
+#undef OPCODE_INFO
+
+
+OperandKind Instruction::kind(int i) const {
+    const OpcodeInfo &info = opcodeInfo[op];
+    return i == 0 ? info.a : i == 1 ? info.b : info.c;
+}
+
+int &Instruction::operand(int i) {
+    return i == 0 ? a : i == 1 ? b : c;
+}
+
+
+FunctionCode::FunctionCode(const string &name, int nparams) : name(name), nparams(nparams), nregs(0), pure(false), memo(NULL), calls(0), native(NULL) {}
+
+FunctionCode::~FunctionCode() {
+    delete memo;
+}
+
+string FunctionCode::toString() const {
+    stringstream ss;
+    ss << "function " << name << " (" << nparams << " params, " << nregs << " registers" << (pure ? ", pure" : "") << ")" << endl;
+    for (size_t i = 0; i < code.size(); i++) {
+        Instruction inst = code[i];
+        ss << "  " << i << "\t[" << lines[i] << "]\t" << opcodeInfo[inst.op].name;
+        for (int j = 0; j < 3; j++) {
+            switch (inst.kind(j)) {
+            case OPERAND_NONE:
+                break;
+            case OPERAND_READ:
+            case OPERAND_WRITE:
+            case OPERAND_BASE:
+                ss << " r" << inst.operand(j);
+                break;
+            case OPERAND_JUMP:
+                ss << " @" << inst.operand(j);
+                break;
+            case OPERAND_NAME:
+                ss << " $" << inst.operand(j);
+                break;
+            case OPERAND_FUNCTION:
+                ss << " f" << inst.operand(j);
+                break;
+            case OPERAND_NATIVE:
+                ss << " n" << inst.operand(j);
+                break;
+            case OPERAND_CONSTANT:
+                ss << " k" << inst.operand(j) << " (" << constants[inst.operand(j)] << ")";
+                break;
+            default:
+                ss << " " << inst.operand(j);
+            }
+        }
+        ss << endl;
+    }
+    return ss.str();
+}
+
+
+Module::~Module() {
+    for (vector<FunctionCode *>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        delete *iter;
+    }
+}
+
+int Module::name(const string &name) {
+    auto iter = nameIndex.find(name);
+    if (iter != nameIndex.end())
+        return iter->second;
+    int index = names.size();
+    names.push_back(name);
+    nameIndex[name] = index;
+    return index;
+}
+
+int Module::native(const NativeFunction *fn) {
+    auto iter = nativeIndex.find(fn);
+    if (iter != nativeIndex.end())
+        return iter->second;
+    int index = natives.size();
+    natives.push_back(fn);
+    nativeIndex[fn] = index;
+    return index;
+}
+
+string Module::toString() const {
+    stringstream ss;
+    for (size_t i = 0; i < names.size(); i++) {
+        ss << "$" << i << " = " << names[i] << endl;
+    }
+    for (size_t i = 0; i < natives.size(); i++) {
+        ss << "n" << i << " = " << natives[i]->name << endl;
+    }
+    for (size_t i = 0; i < functions.size(); i++) {
+        ss << "f" << i << ": " << functions[i]->toString();
+    }
+    return ss.str();
+}
@@ -0,0 +1,142 @@
+#ifndef H_BYTECODE
+#define H_BYTECODE
+
+#include <map>
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+using namespace std;
+
+
+enum OperandKind {
+    OPERAND_NONE,
+    OPERAND_READ,       // register read
+    OPERAND_WRITE,      // register written
+    OPERAND_BASE,       // first of a block of argument registers, result written back to it
+    OPERAND_IMMEDIATE,  // literal value stored in the instruction
+    OPERAND_JUMP,       // absolute instruction index
+    OPERAND_NAME,       // index into Module::names
+    OPERAND_FUNCTION,   // index into Module::functions
+    OPERAND_CONSTANT,   // index into FunctionCode::constants
+    OPERAND_NATIVE,     // index into Module::natives
+};
+
+
+// CALLF and TCALLF are never emitted: the VM rewrites a CALL/TCALL into them once the callee is resolved.
+// TCALL runs the callee in place of the current frame. It is still followed by a RET, which
+// is reached in the main program, where it behaves as a CALL.
+// NATIVE calls a C++ function bound by the resolver, which returns before the next instruction.
+// JGT to JEQI jump when R[a] compares to c that way: a comparison and the JMPT on its result.
+//  name    a                  b                  c
+#define OPCODES(X) \
+    X(NOP,    OPERAND_NONE,     OPERAND_NONE,     OPERAND_NONE) \
+    X(MOVE,   OPERAND_WRITE,    OPERAND_READ,     OPERAND_NONE) \
+    X(LOADI,  OPERAND_WRITE,    OPERAND_IMMEDIATE, OPERAND_NONE) \
+    X(LOADK,  OPERAND_WRITE,    OPERAND_CONSTANT, OPERAND_NONE) \
+    X(ADD,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(SUB,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(MUL,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(DIV,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(GT,     OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(LT,     OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(GE,     OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(LE,     OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(EQ,     OPERAND_WRITE,    OPERAND_READ,     OPERAND_READ) \
+    X(ADDI,   OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(SUBI,   OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(MULI,   OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(DIVI,   OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(GTI,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(LTI,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(GEI,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(LEI,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(EQI,    OPERAND_WRITE,    OPERAND_READ,     OPERAND_IMMEDIATE) \
+    X(JMP,    OPERAND_NONE,     OPERAND_JUMP,     OPERAND_NONE) \
+    X(JMPF,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_NONE) \
+    X(JMPT,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_NONE) \
+    X(JGT,    OPERAND_READ,     OPERAND_JUMP,     OPERAND_READ) \
+    X(JLT,    OPERAND_READ,     OPERAND_JUMP,     OPERAND_READ) \
+    X(JGE,    OPERAND_READ,     OPERAND_JUMP,     OPERAND_READ) \
+    X(JLE,    OPERAND_READ,     OPERAND_JUMP,     OPERAND_READ) \
+    X(JEQ,    OPERAND_READ,     OPERAND_JUMP,     OPERAND_READ) \
+    X(JGTI,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_IMMEDIATE) \
+    X(JLTI,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_IMMEDIATE) \
+    X(JGEI,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_IMMEDIATE) \
+    X(JLEI,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_IMMEDIATE) \
+    X(JEQI,   OPERAND_READ,     OPERAND_JUMP,     OPERAND_IMMEDIATE) \
+    X(CHKDEF, OPERAND_READ,     OPERAND_NAME,     OPERAND_NONE) \
+    X(CALL,   OPERAND_BASE,     OPERAND_NAME,     OPERAND_IMMEDIATE) \
+    X(CALLF,  OPERAND_BASE,     OPERAND_FUNCTION, OPERAND_IMMEDIATE) \
+    X(TCALL,  OPERAND_BASE,     OPERAND_NAME,     OPERAND_IMMEDIATE) \
+    X(TCALLF, OPERAND_BASE,     OPERAND_FUNCTION, OPERAND_IMMEDIATE) \
+    X(NATIVE, OPERAND_BASE,     OPERAND_NATIVE,   OPERAND_IMMEDIATE) \
+    X(RET,    OPERAND_READ,     OPERAND_NONE,     OPERAND_NONE) \
+    X(PRINT,  OPERAND_READ,     OPERAND_NONE,     OPERAND_NONE) \
+    X(DEFUN,  OPERAND_NAME,     OPERAND_FUNCTION, OPERAND_NONE)
+
+
+#define OPCODE_ENUM(name, a, b, c) OP_##name,
+enum Opcode {
+    OPCODES(OPCODE_ENUM)
+    OP_COUNT
+};
+#undef OPCODE_ENUM
+
+
+struct OpcodeInfo {
+    const char *name;
+    OperandKind a, b, c;
+};
+
+extern const OpcodeInfo opcodeInfo[OP_COUNT];
+
+
+struct Instruction {
+    unsigned int op;
+    int a, b, c;
+
+    OperandKind kind(int operand) const;
+    int &operand(int operand);
+};
+
+
+struct JitState;
+typedef MyObject (*NativeCode)(const MyObject *args, JitState *state);
+
+
+class FunctionCode {
+public:
+    string name;
+    int nparams;
+    int nregs;
+    vector<Instruction> code;
+    vector<int> lines;          // source line of every instruction, for error messages
+    vector<MyObject> constants; // the literals that are not ints, loaded by LOADK
+    bool pure;                  // result depends on the arguments only
+    MemoTable *memo;            // results of earlier calls, attached by the VM when memoizing
+    int calls;                  // calls counted by the VM until the JIT threshold
+    NativeCode native;          // machine code compiled by the JIT, NULL until then
+
+    FunctionCode(const string &name, int nparams);
+    ~FunctionCode();
+    string toString() const;
+};
+
+
+class Module {
+private:
+    map<string, int> nameIndex;
+    map<const NativeFunction *, int> nativeIndex;
+public:
+    vector<string> names;                   // function and variable names referenced by instructions
+    vector<FunctionCode *> functions;       // functions[0] is the main program
+    vector<const NativeFunction *> natives; // called by NATIVE
+
+    ~Module();
+    int name(const string &name);
+    int native(const NativeFunction *fn);
+    string toString() const;
+};
+
+
+#endif /* H_BYTECODE */
@@ -0,0 +1,422 @@
+#include "cache.hpp"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+int CacheWriter::node(CacheKind kind, int lineno, int a, int b, int c) {
+    CacheNode node = {kind, lineno, a, b, c};
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int CacheWriter::binary(CacheKind kind, const Expression &left, const Expression &right) {
+    int l = left.cache(*this);
+    int r = right.cache(*this);
+    return node(kind, 0, 0, l, r);
+}
+
+int CacheWriter::name(const string &name) {
+    auto iter = nameIndex.find(name);
+    if (iter != nameIndex.end())
+        return iter->second;
+    CacheName entry = {(uint32_t)chars.size(), (uint32_t)name.size()};
+    chars += name;
+    names.push_back(entry);
+    nameIndex[name] = names.size() - 1;
+    return names.size() - 1;
+}
+
+int CacheWriter::list(const vector<int> &items) {
+    int index = lists.size();
+    lists.push_back(items.size());
+    lists.insert(lists.end(), items.begin(), items.end());
+    return index;
+}
+
+int CacheWriter::nameList(const vector<string> &names) {
+    vector<int> items;
+    for (vector<string>::const_iterator iter = names.begin(); iter != names.end(); iter++) {
+        items.push_back(name(*iter));
+    }
+    return list(items);
+}
+
+int CacheWriter::expressions(const vector<Expression *> &exprs) {
+    vector<int> items;
+    for (vector<Expression *>::const_iterator iter = exprs.begin(); iter != exprs.end(); iter++) {
+        items.push_back((*iter)->cache(*this));
+    }
+    return list(items);
+}
+
+int CacheWriter::statements(const vector<Statement *> &codes) {
+    vector<int> items;
+    for (vector<Statement *>::const_iterator iter = codes.begin(); iter != codes.end(); iter++) {
+        items.push_back((*iter)->cache(*this));
+    }
+    return list(items);
+}
+
+
+// Written to a temporary file renamed over the cache, so that a reader, or
+// another thread caching the same script, never sees half a file
+bool CacheWriter::write(const string &path, CacheHeader header) {
+    header.nodes = nodes.size();
+    header.lists = lists.size();
+    header.names = names.size();
+    header.chars = chars.size();
+    header.padding = 0;
+
+    string temporary = path + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0)
+        return false;
+    fchmod(fd, 0644);
+    FILE *file = fdopen(fd, "wb");
+    if (file == NULL) {
+        close(fd);
+        unlink(temporary.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(nodes.data(), sizeof(CacheNode), nodes.size(), file) == nodes.size()
+        && fwrite(lists.data(), sizeof(int32_t), lists.size(), file) == lists.size()
+        && fwrite(names.data(), sizeof(CacheName), names.size(), file) == names.size()
+        && fwrite(chars.data(), 1, chars.size(), file) == chars.size();
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        ok = rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok)
+        unlink(temporary.c_str());
+    return ok;
+}
+
+
+// Builds the nodes back out of a mapped file. Every index is checked, so a
+// damaged file is rejected rather than trusted: anything out of range throws.
+class CacheReader {
+private:
+    const CacheNode *nodes;
+    const int32_t *lists;
+    const CacheName *names;
+    const char *chars;
+    const CacheHeader &header;
+    Symbols &symbols;
+
+    const CacheNode &node(int index, int parent) const {
+        // Children come before their parents, which also rules out cycles
+        if (index < 0 || index >= parent)
+            throw StringException("Damaged cache");
+        return nodes[index];
+    }
+
+    int count(int list) const {
+        if (list < 0 || (uint32_t)list >= header.lists || (uint32_t)lists[list] > header.lists - list - 1)
+            throw StringException("Damaged cache");
+        return lists[list];
+    }
+
+public:
+    CacheReader(const char *data, const CacheHeader &header, Symbols &symbols) : header(header), symbols(symbols) {
+        nodes = (const CacheNode *)(data + sizeof(CacheHeader));
+        lists = (const int32_t *)(nodes + header.nodes);
+        names = (const CacheName *)(lists + header.lists);
+        chars = (const char *)(names + header.names);
+    }
+
+    const CacheName &entry(int index) const {
+        if (index < 0 || (uint32_t)index >= header.names
+                || names[index].offset > header.chars || names[index].length > header.chars - names[index].offset)
+            throw StringException("Damaged cache");
+        return names[index];
+    }
+
+    const string &name(int index) const {
+        const CacheName &e = entry(index);
+        return symbols.name(symbols.intern(chars + e.offset, e.length));
+    }
+
+    // Through fromDouble, so that no bits in a damaged file make anything but a double
+    static MyObject real(int32_t low, int32_t high) {
+        uint64_t bits = (uint64_t)(uint32_t)high << 32 | (uint32_t)low;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return MyObject::fromDouble(value);
+    }
+
+    // Made in the program's arena, like the literal it came from
+    MyObject text(int index) const {
+        const CacheName &e = entry(index);
+        return MyObject::fromString(MyString::make(chars + e.offset, e.length));
+    }
+
+    // Children are read before the node is made, so that a damaged cache
+    // throws before the arena holds a node that was never constructed
+    template <class T>
+    Expression *binary(const CacheNode &n, int index) const {
+        Expression *left = expression(n.b, index);
+        Expression *right = expression(n.c, index);
+        return new T(*left, *right);
+    }
+
+    Expression *expression(int index, int parent) const {
+        const CacheNode &n = node(index, parent);
+        switch (n.kind) {
+        case CACHE_LITERAL: return new Literal(n.a);
+        case CACHE_REAL: return new Literal(real(n.a, n.b));
+        case CACHE_STRING: return new Literal(text(n.a));
+        case CACHE_VARIABLE: {
+            const string &variable = name(n.a);
+            return new Variable(variable);
+        }
+        case CACHE_PLUS: return binary<Plus>(n, index);
+        case CACHE_MINUS: return binary<Minus>(n, index);
+        case CACHE_TIMES: return binary<Times>(n, index);
+        case CACHE_DIVIDE: return binary<Divide>(n, index);
+        case CACHE_GT: return binary<GreaterThan>(n, index);
+        case CACHE_LT: return binary<LessThan>(n, index);
+        case CACHE_GE: return binary<GreaterEqual>(n, index);
+        case CACHE_LE: return binary<LessEqual>(n, index);
+        case CACHE_EQ: return binary<Equal>(n, index);
+        case CACHE_AND: return binary<LogicalAnd>(n, index);
+        case CACHE_OR: return binary<LogicalOr>(n, index);
+        case CACHE_CALL: {
+            vector<Expression *> args;
+            for (int i = 0, N = count(n.b); i < N; i++) {
+                args.push_back(expression(lists[n.b + 1 + i], index));
+            }
+            const string &callee = name(n.a);
+            return new Call(callee, args);
+        }
+        default:
+            throw StringException("Damaged cache");
+        }
+    }
+
+    Statement *statement(int index, int parent) const {
+        const CacheNode &n = node(index, parent);
+        Statement *stmt;
+        switch (n.kind) {
+        case CACHE_ASSIGNMENT: {
+            const string &variable = name(n.a);
+            Expression *value = expression(n.b, index);
+            stmt = new Assignment(variable, value);
+            break;
+        }
+        case CACHE_PRINT: { Expression *value = expression(n.b, index); stmt = new Print(value); break; }
+        case CACHE_RETURN: { Expression *value = expression(n.b, index); stmt = new Return(value); break; }
+        case CACHE_IF: { Expression *condition = expression(n.b, index); stmt = new If(condition, n.c); break; }
+        case CACHE_JUMP: stmt = new Jump(n.c); break;
+        case CACHE_LOOP: { Expression *condition = expression(n.b, index); stmt = new Loop(condition, n.c); break; }
+        case CACHE_FUNCTION: {
+            vector<string> params;
+            for (int i = 0, N = count(n.b); i < N; i++) {
+                params.push_back(name(lists[n.b + 1 + i]));
+            }
+            const string &function = name(n.a);
+            vector<Statement *> body = statements(n.c, index);
+            stmt = new Function(function, params, body);
+            break;
+        }
+        default:
+            throw StringException("Damaged cache");
+        }
+        stmt->setLineno(n.lineno);
+        return stmt;
+    }
+
+    vector<Statement *> statements(int list, int parent) const {
+        vector<Statement *> codes;
+        for (int i = 0, N = count(list); i < N; i++) {
+            codes.push_back(statement(lists[list + 1 + i], parent));
+        }
+        // A branch lands inside its own block, or just past its end
+        for (int i = 0, N = codes.size(); i < N; i++) {
+            const Branch *branch = dynamic_cast<const Branch *>(codes[i]);
+            if (branch && (i + branch->getSkiprows() + 1 < 0 || i + branch->getSkiprows() + 1 > N))
+                throw StringException("Damaged cache");
+        }
+        return codes;
+    }
+};
+
+
+// NULL unless the file is a complete cache of the source described by `source`
+static Program *readCache(const string &path, const CacheHeader &source) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    const CacheHeader &header = *(const CacheHeader *)data;
+    size_t expected = sizeof(CacheHeader) + (size_t)header.nodes * sizeof(CacheNode)
+        + (size_t)header.lists * sizeof(int32_t) + (size_t)header.names * sizeof(CacheName) + header.chars;
+    Program *program = NULL;
+    if (header.magic == source.magic && header.version == source.version && header.sourceSize == source.sourceSize
+            && header.sourceMtime == source.sourceMtime && header.sourceHash == source.sourceHash && size == expected) {
+        program = new Program();
+        try {
+            Arena::Scope scope(&program->arena);
+            CacheReader reader((const char *)data, header, program->symbols);
+            program->statements = reader.statements(header.program, header.nodes);
+        } catch (const StringException &e) {
+            delete program;
+            program = NULL;
+        }
+    }
+    munmap(data, size);
+    return program;
+}
+
+
+// FNV-1a
+static uint64_t hashSource(const char *source, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)source[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+Program *loadProgram(const string &path) {
+    SourceFile source(path);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        throw StringException("Can't open file");
+
+    CacheHeader header;
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.sourceSize = source.getSize();
+    header.sourceMtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    // Before parsing, which scans the source in place
+    header.sourceHash = hashSource(source.getData(), source.getSize());
+
+    string cachePath = path + CACHE_SUFFIX;
+    Program *program = readCache(cachePath, header);
+    if (program)
+        return program;
+
+    program = parseBuffer(source.getData(), source.getSize());
+    CacheWriter writer;
+    header.program = writer.statements(program->statements);
+    writer.write(cachePath, header);
+    return program;
+}
+
+
+int Plus::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_PLUS, left, right);
+}
+
+int Minus::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_MINUS, left, right);
+}
+
+int Times::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_TIMES, left, right);
+}
+
+int Divide::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_DIVIDE, left, right);
+}
+
+int GreaterThan::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_GT, left, right);
+}
+
+int LessThan::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_LT, left, right);
+}
+
+int GreaterEqual::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_GE, left, right);
+}
+
+int LessEqual::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_LE, left, right);
+}
+
+int Equal::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_EQ, left, right);
+}
+
+int LogicalAnd::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_AND, left, right);
+}
+
+int LogicalOr::cache(CacheWriter &writer) const {
+    return writer.binary(CACHE_OR, left, right);
+}
+
+int Literal::cache(CacheWriter &writer) const {
+    if (value.isString()) {
+        const MyString *text = value.getString();
+        return writer.node(CACHE_STRING, 0, writer.name(string(text->chars, text->length)), 0, 0);
+    }
+    if (value.isDouble()) {
+        uint64_t bits = value.getBits() - OBJECT_DOUBLE_OFFSET;
+        return writer.node(CACHE_REAL, 0, (int32_t)bits, (int32_t)(bits >> 32), 0);
+    }
+    return writer.node(CACHE_LITERAL, 0, value.getInt(), 0, 0);
+}
+
+int Variable::cache(CacheWriter &writer) const {
+    return writer.node(CACHE_VARIABLE, 0, writer.name(name), 0, 0);
+}
+
+int Call::cache(CacheWriter &writer) const {
+    int list = writer.expressions(args);
+    return writer.node(CACHE_CALL, 0, writer.name(name), list, 0);
+}
+
+
+int If::cache(CacheWriter &writer) const {
+    int expr = condition->cache(writer);
+    return writer.node(CACHE_IF, lineno, 0, expr, skiprows);
+}
+
+int Jump::cache(CacheWriter &writer) const {
+    return writer.node(CACHE_JUMP, lineno, 0, 0, skiprows);
+}
+
+int Loop::cache(CacheWriter &writer) const {
+    int expr = condition->cache(writer);
+    return writer.node(CACHE_LOOP, lineno, 0, expr, skiprows);
+}
+
+int Assignment::cache(CacheWriter &writer) const {
+    int value = expr->cache(writer);
+    return writer.node(CACHE_ASSIGNMENT, lineno, writer.name(name), value, 0);
+}
+
+int Function::cache(CacheWriter &writer) const {
+    int params = writer.nameList(arguments);
+    int body = writer.statements(statements);
+    return writer.node(CACHE_FUNCTION, lineno, writer.name(name), params, body);
+}
+
+int Print::cache(CacheWriter &writer) const {
+    int value = expr->cache(writer);
+    return writer.node(CACHE_PRINT, lineno, 0, value, 0);
+}
+
+int Return::cache(CacheWriter &writer) const {
+    int value = expr->cache(writer);
+    return writer.node(CACHE_RETURN, lineno, 0, value, 0);
+}
@@ -0,0 +1,106 @@
+#ifndef H_CACHE
+#define H_CACHE
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+#include "parser.hpp"
+using namespace std;
+
+
+// A script's cache is written next to it with this suffix, "a.my" -> "a.myc"
+#define CACHE_SUFFIX "c"
+
+// First bytes of every cache file, and the layout version: bump it whenever the layout changes
+#define CACHE_MAGIC 0x3143594d          // "MYC1"
+#define CACHE_VERSION 2
+
+
+enum CacheKind {
+    CACHE_LITERAL,          // a: value of an int
+    CACHE_REAL,             // a and b: low and high half of the bits of a double
+    CACHE_STRING,           // a: characters, as a name
+    CACHE_VARIABLE,         // a: name
+    CACHE_PLUS,             // binary operators, b and c: operands
+    CACHE_MINUS,
+    CACHE_TIMES,
+    CACHE_DIVIDE,
+    CACHE_GT,
+    CACHE_LT,
+    CACHE_GE,
+    CACHE_LE,
+    CACHE_EQ,
+    CACHE_AND,
+    CACHE_OR,
+    CACHE_CALL,             // a: name, b: list of arguments
+    CACHE_ASSIGNMENT,       // a: name, b: value
+    CACHE_PRINT,            // b: value
+    CACHE_RETURN,           // b: value
+    CACHE_IF,               // b: condition, c: rows skipped when false
+    CACHE_JUMP,             // c: rows skipped
+    CACHE_FUNCTION,         // a: name, b: list of parameter names, c: list of statements
+    CACHE_LOOP,             // b: condition, c: rows skipped when true
+    CACHE_KINDS,
+};
+
+
+// The file is the header followed by its tables, in this order. Nodes refer to
+// each other, to names and to lists only by index, never by address, so the
+// mapped file is used in place. A node only refers to nodes before it.
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceSize;                // the source it was parsed from
+    int64_t sourceMtime;                // nanoseconds
+    uint64_t sourceHash;
+    uint32_t nodes;                     // entries in every table
+    uint32_t lists;
+    uint32_t names;
+    uint32_t chars;
+    uint32_t program;                   // list of the top-level statements
+    uint32_t padding;
+};
+
+struct CacheNode {
+    int32_t kind;
+    int32_t lineno;                     // statements only
+    int32_t a, b, c;
+};
+
+struct CacheName {
+    uint32_t offset;                    // into the characters, which are not terminated
+    uint32_t length;
+};
+
+
+// Flattens a parsed program into the tables of a cache file. Nodes add
+// themselves through cache() and get back their index.
+class CacheWriter {
+private:
+    vector<CacheNode> nodes;
+    vector<int32_t> lists;              // every list is its length followed by its items
+    vector<CacheName> names;
+    map<string, int> nameIndex;
+    string chars;
+
+public:
+    int node(CacheKind kind, int lineno, int a, int b, int c);
+    int binary(CacheKind kind, const Expression &left, const Expression &right);
+    int name(const string &name);
+    int list(const vector<int> &items);
+    int nameList(const vector<string> &names);
+    int expressions(const vector<Expression *> &exprs);
+    int statements(const vector<Statement *> &codes);
+    bool write(const string &path, CacheHeader header);
+};
+
+
+// Loads the program from the cache next to the script when it was written for
+// exactly this source, otherwise parses the script and writes a fresh cache.
+// A cache that cannot be written is only a missed opportunity.
+Program *loadProgram(const string &path);
+
+
+#endif /* H_CACHE */
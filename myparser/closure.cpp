@@ -0,0 +1,701 @@
+#include "closure.hpp"
+#include "memo.hpp"
+#include "natives.hpp"
+#include <algorithm>
+#include <pthread.h>
+#include <sstream>
+
+
+// Frames and argument lists up to this size live on the native stack
+#define CLOSURE_SMALL 8
+
+// Native stack reserved per nested call, on top of a fixed base. An unoptimized
+// build takes a little over 1KB per call, -O2 about 800 bytes.
+#define CLOSURE_FRAME_BYTES 1536
+#define CLOSURE_STACK_BASE (64 << 20)
+
+// Left unused at the end of the native stack, for whatever runs after the last check
+#define CLOSURE_STACK_MARGIN (1 << 20)
+
+
+// Operand kinds, read without testing what they are
+
+struct LiteralOperand {
+    static MyObject get(const ClosureOperand &o, ClosureFrame &f) {
+        return o.value;
+    }
+};
+
+struct SlotOperand {
+    static MyObject get(const ClosureOperand &o, ClosureFrame &f) {
+        if (!f.defined[o.slot])
+            throw StringException("Variable not found: " + *o.name);
+        return f.slots[o.slot];
+    }
+};
+
+struct NodeOperand {
+    static MyObject get(const ClosureOperand &o, ClosureFrame &f) {
+        return o.node->eval(o.node, f);
+    }
+};
+
+static MyObject getOperand(const ClosureOperand &o, ClosureFrame &f) {
+    switch (o.kind) {
+    case CLOSURE_LITERAL:
+        return LiteralOperand::get(o, f);
+    case CLOSURE_SLOT:
+        return SlotOperand::get(o, f);
+    default:
+        return NodeOperand::get(o, f);
+    }
+}
+
+
+// Operators. The left operand is always read first, like in the other engines.
+
+#define CLOSURE_OPERATOR(name, function) \
+struct name { \
+    template <class L, class R> \
+    static MyObject apply(const ClosureOperand &l, const ClosureOperand &r, ClosureFrame &f) { \
+        MyObject left = L::get(l, f); \
+        return function(left, R::get(r, f)); \
+    } \
+};
+
+CLOSURE_OPERATOR(OpAdd, objectAdd)
+CLOSURE_OPERATOR(OpSub, objectSubtract)
+CLOSURE_OPERATOR(OpMul, objectMultiply)
+CLOSURE_OPERATOR(OpDiv, objectDivide)
+CLOSURE_OPERATOR(OpGt, objectGreater)
+CLOSURE_OPERATOR(OpLt, objectLess)
+CLOSURE_OPERATOR(OpGe, objectGreaterEqual)
+CLOSURE_OPERATOR(OpLe, objectLessEqual)
+CLOSURE_OPERATOR(OpEq, objectEqual)
+#undef CLOSURE_OPERATOR
+
+struct OpAnd {
+    template <class L, class R>
+    static MyObject apply(const ClosureOperand &l, const ClosureOperand &r, ClosureFrame &f) {
+        return L::get(l, f).truthy() ? R::get(r, f) : false;
+    }
+};
+
+struct OpOr {
+    template <class L, class R>
+    static MyObject apply(const ClosureOperand &l, const ClosureOperand &r, ClosureFrame &f) {
+        return L::get(l, f).truthy() ? true : R::get(r, f);
+    }
+};
+
+
+// Closures
+
+template <class Op, class L, class R>
+struct Binary {
+    static MyObject run(const ClosureExpr *e, ClosureFrame &f) {
+        return Op::template apply<L, R>(e->left, e->right, f);
+    }
+};
+
+template <class Op, class L, class R>
+struct BranchBinary {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        return Op::template apply<L, R>(s->left, s->right, f).truthy() ? pc + 1 : s->target;
+    }
+};
+
+template <class Op, class L, class R>
+struct LoopBinary {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        return Op::template apply<L, R>(s->left, s->right, f).truthy() ? s->target : pc + 1;
+    }
+};
+
+template <class K>
+struct Assign {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        f.slots[s->target] = K::get(s->left, f);
+        f.defined[s->target] = 1;
+        return pc + 1;
+    }
+};
+
+template <class K>
+struct PrintValue {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        *f.engine->out << K::get(s->left, f) << '\n';
+        return pc + 1;
+    }
+};
+
+template <class K>
+struct BranchValue {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        return K::get(s->left, f).truthy() ? pc + 1 : s->target;
+    }
+};
+
+template <class K>
+struct LoopValue {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        return K::get(s->left, f).truthy() ? s->target : pc + 1;
+    }
+};
+
+template <class K>
+struct ReturnValue {
+    static int run(const ClosureStmt *s, ClosureFrame &f, int pc) {
+        f.result = K::get(s->left, f);
+        return CLOSURE_RETURN;
+    }
+};
+
+static int jump(const ClosureStmt *s, ClosureFrame &f, int pc) {
+    return s->target;
+}
+
+static int define(const ClosureStmt *s, ClosureFrame &f, int pc) {
+    f.engine->define(s->function);
+    return pc + 1;
+}
+
+
+// The specialization for the given operand kinds
+
+template <template <class> class T>
+static decltype(&T<LiteralOperand>::run) unary(ClosureKind kind) {
+    switch (kind) {
+    case CLOSURE_LITERAL:
+        return &T<LiteralOperand>::run;
+    case CLOSURE_SLOT:
+        return &T<SlotOperand>::run;
+    default:
+        return &T<NodeOperand>::run;
+    }
+}
+
+template <template <class, class, class> class T, class Op, class L>
+static decltype(&T<Op, L, L>::run) binaryRight(ClosureKind right) {
+    switch (right) {
+    case CLOSURE_LITERAL:
+        return &T<Op, L, LiteralOperand>::run;
+    case CLOSURE_SLOT:
+        return &T<Op, L, SlotOperand>::run;
+    default:
+        return &T<Op, L, NodeOperand>::run;
+    }
+}
+
+template <template <class, class, class> class T, class Op>
+static decltype(&T<Op, LiteralOperand, LiteralOperand>::run) binary(ClosureKind left, ClosureKind right) {
+    switch (left) {
+    case CLOSURE_LITERAL:
+        return binaryRight<T, Op, LiteralOperand>(right);
+    case CLOSURE_SLOT:
+        return binaryRight<T, Op, SlotOperand>(right);
+    default:
+        return binaryRight<T, Op, NodeOperand>(right);
+    }
+}
+
+
+// Calls
+
+static const ClosureFunction *callee(const ClosureCall *call, ClosureEngine *engine) {
+    return call->version == engine->version ? call->callee : engine->link(call);
+}
+
+static MyObject call(const ClosureExpr *e, ClosureFrame &f) {
+    const ClosureCall *call = e->call;
+    const ClosureFunction *fn = callee(call, f.engine);
+    int N = call->args.size();
+    MyObject small[CLOSURE_SMALL];
+    vector<MyObject> large;
+    MyObject *args = small;
+    if (N > CLOSURE_SMALL) {
+        large.resize(N);
+        args = large.data();
+    }
+    for (int i = 0; i < N; i++) {
+        args[i] = getOperand(call->args[i], f);
+    }
+    return f.engine->invoke(fn, args);
+}
+
+static MyObject nativeCall(const ClosureExpr *e, ClosureFrame &f) {
+    const ClosureCall *call = e->call;
+    int N = call->args.size();
+    MyObject small[CLOSURE_SMALL];
+    vector<MyObject> large;
+    MyObject *args = small;
+    if (N > CLOSURE_SMALL) {
+        large.resize(N);
+        args = large.data();
+    }
+    for (int i = 0; i < N; i++) {
+        args[i] = getOperand(call->args[i], f);
+    }
+    return f.engine->invokeNative(call->native, args, N);
+}
+
+// Leaves the callee and its arguments for invoke() to run in place of the current frame.
+// The arguments are only copied out once all are evaluated: calls among them may make tail calls too.
+static int tailCall(const ClosureStmt *s, ClosureFrame &f, int pc) {
+    const ClosureCall *call = s->call;
+    ClosureEngine *engine = f.engine;
+    const ClosureFunction *fn = callee(call, engine);
+    int N = call->args.size();
+    MyObject small[CLOSURE_SMALL];
+    vector<MyObject> large;
+    MyObject *args = small;
+    if (N > CLOSURE_SMALL) {
+        large.resize(N);
+        args = large.data();
+    }
+    for (int i = 0; i < N; i++) {
+        args[i] = getOperand(call->args[i], f);
+    }
+    engine->tailArgs.assign(args, args + N);
+    engine->tailCallee = fn;
+    return CLOSURE_TAIL;
+}
+
+
+ClosureCompiler::ClosureCompiler(ClosureEngine *engine) : engine(engine), code(NULL) {}
+
+
+ClosureFunction *ClosureCompiler::compile(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure) {
+    code = engine->newFunction(name, nparams, nslots, pure);
+    for (vector<Statement *>::const_iterator iter = codes.begin(); iter != codes.end(); iter++) {
+        (*iter)->closure(*this);
+    }
+    return code;
+}
+
+
+ClosureOperand ClosureCompiler::literal(MyObject value) {
+    ClosureOperand o = {CLOSURE_LITERAL, value, 0, NULL, NULL};
+    return o;
+}
+
+
+ClosureOperand ClosureCompiler::slot(int slot, const string &name) {
+    ClosureOperand o = {CLOSURE_SLOT, 0, slot, &name, NULL};
+    return o;
+}
+
+
+ClosureOperand ClosureCompiler::node(ClosureExpr *expr) {
+    ClosureOperand o = {CLOSURE_NODE, 0, 0, NULL, expr};
+    return o;
+}
+
+
+template <class Op>
+ClosureOperand ClosureCompiler::binary(const Expression &left, const Expression &right) {
+    ClosureOperand l = left.closure(*this);
+    ClosureOperand r = right.closure(*this);
+    ClosureExpr *expr = engine->newNode();
+    expr->eval = ::binary<Binary, Op>(l.kind, r.kind);
+    expr->branch = ::binary<BranchBinary, Op>(l.kind, r.kind);
+    expr->loop = ::binary<LoopBinary, Op>(l.kind, r.kind);
+    expr->left = l;
+    expr->right = r;
+    return node(expr);
+}
+
+
+ClosureOperand ClosureCompiler::call(const string &name, const vector<Expression *> &args, const NativeFunction *native) {
+    ClosureCall *call = engine->newCall(name);
+    call->native = native;
+    for (vector<Expression *>::const_iterator iter = args.begin(); iter != args.end(); iter++) {
+        call->args.push_back((*iter)->closure(*this));
+    }
+    ClosureExpr *expr = engine->newNode();
+    expr->eval = native ? &nativeCall : &::call;
+    expr->call = call;
+    return node(expr);
+}
+
+
+ClosureStmt &ClosureCompiler::emit(ClosureStmt::Exec exec, int lineno) {
+    ClosureStmt stmt = {exec, lineno, 0, literal(0), literal(0), NULL, NULL};
+    code->body.push_back(stmt);
+    return code->body.back();
+}
+
+
+int ClosureCompiler::target(int skiprows) const {
+    return code->body.size() + skiprows + 1;
+}
+
+
+const ClosureFunction *ClosureCompiler::function(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure) {
+    ClosureCompiler compiler(engine);
+    return compiler.compile(name, nparams, nslots, codes, pure);
+}
+
+
+ClosureEngine::ClosureEngine(int maxDepth, size_t memoSize, Tracer *tracer, Stats *stats, ostream *out)
+    : maxDepth(maxDepth), memoSize(memoSize), depth(0), stackBase(NULL), stackLimit(0), errorLine(-1),
+      tracer(tracer), stats(stats), main(NULL), heap(NULL), failed(false), out(out), version(1), tailCallee(NULL) {}
+
+
+ClosureEngine::~ClosureEngine() {
+    for (vector<ClosureFunction *>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        delete (*iter)->memo;
+        delete *iter;
+    }
+    for (vector<ClosureExpr *>::iterator iter = nodes.begin(); iter != nodes.end(); iter++) {
+        delete *iter;
+    }
+    for (vector<ClosureCall *>::iterator iter = calls.begin(); iter != calls.end(); iter++) {
+        delete *iter;
+    }
+}
+
+
+ClosureFunction *ClosureEngine::newFunction(const string &name, int nparams, int nslots, bool pure) {
+    ClosureFunction *fn = new ClosureFunction();
+    fn->name = name;
+    fn->nparams = nparams;
+    fn->nslots = nslots;
+    fn->memo = pure && memoSize > 0 ? new MemoTable(name, nparams, memoSize) : NULL;
+    functions.push_back(fn);
+    return fn;
+}
+
+
+ClosureExpr *ClosureEngine::newNode() {
+    ClosureExpr *expr = new ClosureExpr();
+    nodes.push_back(expr);
+    return expr;
+}
+
+
+ClosureCall *ClosureEngine::newCall(const string &name) {
+    ClosureCall *call = new ClosureCall();
+    call->name = name;
+    call->callee = NULL;
+    call->version = 0;
+    call->native = NULL;
+    calls.push_back(call);
+    return call;
+}
+
+
+// The first definition of a name wins
+void ClosureEngine::define(const ClosureFunction *fn) {
+    if (bindings.find(fn->name) == bindings.end()) {
+        bindings[fn->name] = fn;
+        version++;
+    }
+}
+
+
+// Resolves a call site and checks its arity, then caches the result until the next definition
+const ClosureFunction *ClosureEngine::link(const ClosureCall *call) {
+    stats->cacheMisses++;
+    auto iter = bindings.find(call->name);
+    if (iter == bindings.end())
+        throw StringException("Cannot find function " + call->name);
+    const ClosureFunction *fn = iter->second;
+    if (fn->nparams != (int)call->args.size()) {
+        stringstream ss;
+        ss << "Function " << call->name << " takes " << fn->nparams << " arguments, " << call->args.size() << " given";
+        throw StringException(ss.str());
+    }
+    call->callee = fn;
+    call->version = version;
+    return fn;
+}
+
+
+// Runs a body until it returns; CLOSURE_RETURN leaves the value in the frame.
+// The innermost body being unwound by an error records where it happened.
+int ClosureEngine::execute(const ClosureFunction *fn, ClosureFrame &frame) {
+    const ClosureStmt *body = fn->body.data();
+    int N = fn->body.size();
+    int pc = 0;
+    try {
+        while (pc >= 0 && pc < N) {
+            stats->statements++;
+            pc = body[pc].exec(&body[pc], frame, pc);
+        }
+    } catch (StringException &e) {
+        if (errorLine < 0)
+            errorLine = body[pc].lineno;
+        throw;
+    }
+    if (pc >= N) {
+        frame.result = 0;       // falling off the end returns 0
+        return CLOSURE_RETURN;
+    }
+    return pc;
+}
+
+
+// Tail calls loop here instead of nesting. A memoized callee is called normally
+// instead, so that it gets to look up and store its result.
+MyObject ClosureEngine::invoke(const ClosureFunction *fn, const MyObject *args) {
+    char marker;
+    if (depth >= maxDepth || (size_t)(stackBase - &marker) > stackLimit) {
+        stringstream ss;
+        ss << "Stack overflow: more than " << depth << " nested calls";
+        throw StringException(ss.str());
+    }
+    stats->calls++;
+    TRACE(*tracer, TRACE_CALL, "call " << fn->name << traceArgs(args, fn->nparams));
+    MyObject result;
+    if (fn->memo && fn->memo->lookup(args, &result)) {
+        TRACE(*tracer, TRACE_CALL, "return " << result << " (memo)");
+        return result;
+    }
+
+    depth++;
+    stats->frames++;
+    stats->depth(depth + 1);
+    MyObject smallSlots[CLOSURE_SMALL];
+    char smallDefined[CLOSURE_SMALL];
+    vector<MyObject> largeSlots;
+    vector<char> largeDefined;
+    ClosureFrame frame = {smallSlots, smallDefined, 0, this};
+    const ClosureFunction *current = fn;
+    const MyObject *currentArgs = args;
+    for (;;) {
+        int N = current->nslots;
+        if (N > CLOSURE_SMALL) {
+            largeSlots.resize(N);
+            largeDefined.resize(N);
+            frame.slots = largeSlots.data();
+            frame.defined = largeDefined.data();
+        }
+        copy(currentArgs, currentArgs + current->nparams, frame.slots);
+        fill(frame.defined, frame.defined + current->nparams, 1);
+        fill(frame.defined + current->nparams, frame.defined + N, 0);
+
+        if (execute(current, frame) == CLOSURE_RETURN) {
+            result = frame.result;
+            break;
+        }
+        current = tailCallee;
+        if (current->memo) {
+            vector<MyObject> tail(tailArgs);
+            result = invoke(current, tail.data());
+            break;
+        }
+        currentArgs = tailArgs.data();
+        stats->calls++;
+        TRACE(*tracer, TRACE_CALL, "tail call " << current->name << traceArgs(currentArgs, current->nparams));
+    }
+    depth--;
+    TRACE(*tracer, TRACE_CALL, "return " << result);
+    if (fn->memo)
+        fn->memo->store(args, result);
+    return result;
+}
+
+MyObject ClosureEngine::invokeNative(const NativeFunction *fn, const MyObject *args, int nargs) {
+    stats->calls++;
+    TRACE(*tracer, TRACE_CALL, "call " << fn->name << traceArgs(args, nargs));
+    return callNative(fn, args, nargs);
+}
+
+
+void *ClosureEngine::start(void *engine) {
+    ((ClosureEngine *)engine)->runMain();
+    return NULL;
+}
+
+
+void ClosureEngine::runMain() {
+    Arena::Scope scope(heap);
+    char marker;
+    stackBase = &marker;
+    vector<MyObject> slots(main->nslots);
+    vector<char> defined(main->nslots, 0);
+    ClosureFrame frame = {slots.data(), defined.data(), 0, this};
+    stats->frames++;
+    stats->depth(1);
+    try {
+        // Returning from the main program ends it, a tail call there is an ordinary call
+        if (execute(main, frame) == CLOSURE_TAIL) {
+            vector<MyObject> args(tailArgs);
+            invoke(tailCallee, args.data());
+        }
+    } catch (const StringException &e) {
+        *out << errorLine << ": " << e.msg << '\n';
+        failed = true;
+    }
+}
+
+
+// Runs on a thread with a stack for maxDepth nested calls, or on the
+// current one with what is left of it if no such thread can be made.
+// False when the script stopped on an error, printed to out.
+bool ClosureEngine::run(const ClosureFunction *main) {
+    this->main = main;
+    heap = Arena::inScope();
+    size_t size = CLOSURE_STACK_BASE + (size_t)maxDepth * CLOSURE_FRAME_BYTES;
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    stackLimit = size - CLOSURE_STACK_MARGIN;
+    if (pthread_attr_setstacksize(&attr, size) == 0 && pthread_create(&thread, &attr, start, this) == 0) {
+        pthread_join(thread, NULL);
+    } else {
+        stackLimit = (8 << 20) - CLOSURE_STACK_MARGIN;
+        runMain();
+    }
+    pthread_attr_destroy(&attr);
+    return !failed;
+}
+
+
+void ClosureEngine::report(ostream &out) const {
+    for (vector<ClosureFunction *>::const_iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        if ((*iter)->memo)
+            (*iter)->memo->report(out);
+    }
+}
+
+
+ClosureOperand Plus::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpAdd>(left, right);
+}
+
+
+ClosureOperand Minus::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpSub>(left, right);
+}
+
+
+ClosureOperand Times::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpMul>(left, right);
+}
+
+
+ClosureOperand Divide::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpDiv>(left, right);
+}
+
+
+ClosureOperand GreaterThan::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpGt>(left, right);
+}
+
+
+ClosureOperand LessThan::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpLt>(left, right);
+}
+
+
+ClosureOperand GreaterEqual::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpGe>(left, right);
+}
+
+
+ClosureOperand LessEqual::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpLe>(left, right);
+}
+
+
+ClosureOperand Equal::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpEq>(left, right);
+}
+
+
+ClosureOperand LogicalAnd::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpAnd>(left, right);
+}
+
+
+ClosureOperand LogicalOr::closure(ClosureCompiler &compiler) const {
+    return compiler.binary<OpOr>(left, right);
+}
+
+
+ClosureOperand Literal::closure(ClosureCompiler &compiler) const {
+    return compiler.literal(value);
+}
+
+
+ClosureOperand Variable::closure(ClosureCompiler &compiler) const {
+    return compiler.slot(slot, name);
+}
+
+
+ClosureOperand Call::closure(ClosureCompiler &compiler) const {
+    return compiler.call(name, args, native);
+}
+
+
+// A comparison or arithmetic condition is tested by the branch itself
+void If::closure(ClosureCompiler &compiler) const {
+    ClosureOperand cond = condition->closure(compiler);
+    int target = compiler.target(skiprows);
+    if (cond.kind == CLOSURE_NODE && cond.node->branch) {
+        ClosureStmt &stmt = compiler.emit(cond.node->branch, lineno);
+        stmt.left = cond.node->left;
+        stmt.right = cond.node->right;
+        stmt.target = target;
+    } else {
+        ClosureStmt &stmt = compiler.emit(unary<BranchValue>(cond.kind), lineno);
+        stmt.left = cond;
+        stmt.target = target;
+    }
+}
+
+
+void Jump::closure(ClosureCompiler &compiler) const {
+    int target = compiler.target(skiprows);
+    compiler.emit(&jump, lineno).target = target;
+}
+
+
+void Loop::closure(ClosureCompiler &compiler) const {
+    ClosureOperand cond = condition->closure(compiler);
+    int target = compiler.target(skiprows);
+    if (cond.kind == CLOSURE_NODE && cond.node->loop) {
+        ClosureStmt &stmt = compiler.emit(cond.node->loop, lineno);
+        stmt.left = cond.node->left;
+        stmt.right = cond.node->right;
+        stmt.target = target;
+    } else {
+        ClosureStmt &stmt = compiler.emit(unary<LoopValue>(cond.kind), lineno);
+        stmt.left = cond;
+        stmt.target = target;
+    }
+}
+
+
+void Assignment::closure(ClosureCompiler &compiler) const {
+    ClosureOperand value = expr->closure(compiler);
+    ClosureStmt &stmt = compiler.emit(unary<Assign>(value.kind), lineno);
+    stmt.left = value;
+    stmt.target = slot;
+}
+
+
+void Function::closure(ClosureCompiler &compiler) const {
+    const ClosureFunction *fn = compiler.function(name, arguments.size(), nslots, statements, pure);
+    compiler.emit(&define, lineno).function = fn;
+}
+
+
+void Print::closure(ClosureCompiler &compiler) const {
+    ClosureOperand value = expr->closure(compiler);
+    compiler.emit(unary<PrintValue>(value.kind), lineno).left = value;
+}
+
+
+void Return::closure(ClosureCompiler &compiler) const {
+    ClosureOperand value = expr->closure(compiler);
+    const Call *call = dynamic_cast<const Call *>(expr);
+    if (call && call->isTail()) {
+        compiler.emit(&tailCall, lineno).call = value.node->call;
+    } else {
+        compiler.emit(unary<ReturnValue>(value.kind), lineno).left = value;
+    }
+}
@@ -0,0 +1,163 @@
+#ifndef H_CLOSURE
+#define H_CLOSURE
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+using namespace std;
+
+
+// Closure compilation: every expression and statement is turned once into a
+// record holding a function pointer specialized for the kinds of its operands
+// (literal, frame slot or subexpression), so running the program takes no
+// virtual calls and no tests on what an operand is. Calls recurse on the
+// native stack, so the program runs on a thread whose stack fits maxDepth frames.
+
+class ClosureEngine;
+class Tracer;
+class Stats;
+struct ClosureExpr;
+struct ClosureFunction;
+
+
+struct ClosureFrame {
+    MyObject *slots;
+    char *defined;
+    MyObject result;                // value of the Return that ended the body
+    ClosureEngine *engine;
+};
+
+
+enum ClosureKind {
+    CLOSURE_LITERAL,
+    CLOSURE_SLOT,
+    CLOSURE_NODE,
+};
+
+struct ClosureOperand {
+    ClosureKind kind;
+    MyObject value;                 // CLOSURE_LITERAL
+    int slot;                       // CLOSURE_SLOT, with its name for errors
+    const string *name;
+    const ClosureExpr *node;        // CLOSURE_NODE
+};
+
+
+struct ClosureCall {
+    string name;
+    vector<ClosureOperand> args;
+    mutable const ClosureFunction *callee;  // inline cache, valid while version matches the engine's
+    mutable unsigned version;
+    const NativeFunction *native;           // bound by the resolver, called without a frame
+};
+
+
+struct ClosureStmt;
+
+struct ClosureExpr {
+    typedef MyObject (*Eval)(const ClosureExpr *, ClosureFrame &);
+    typedef int (*Branch)(const ClosureStmt *, ClosureFrame &, int pc);
+
+    Eval eval;
+    Branch branch;                  // the same test fused into an If, NULL if it has none
+    Branch loop;                    // and into a Loop, which jumps when it holds
+    ClosureOperand left, right;
+    const ClosureCall *call;
+};
+
+
+// Executing a statement returns the next one to run, or one of these
+#define CLOSURE_RETURN -1
+#define CLOSURE_TAIL -2
+
+struct ClosureStmt {
+    typedef int (*Exec)(const ClosureStmt *, ClosureFrame &, int pc);
+
+    Exec exec;
+    int lineno;
+    int target;                     // slot assigned or statement jumped to
+    ClosureOperand left, right;     // the value, or the operands of a fused comparison
+    const ClosureCall *call;        // tail call
+    const ClosureFunction *function;    // definition
+};
+
+
+struct ClosureFunction {
+    string name;
+    int nparams;
+    int nslots;
+    vector<ClosureStmt> body;
+    MemoTable *memo;                // NULL unless the function is pure and memoization is on
+};
+
+
+class ClosureCompiler {
+private:
+    ClosureEngine *engine;
+    ClosureFunction *code;              // the body being compiled
+
+public:
+    ClosureCompiler(ClosureEngine *engine);
+
+    ClosureFunction *compile(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure);
+
+    ClosureOperand literal(MyObject value);
+    ClosureOperand slot(int slot, const string &name);
+    ClosureOperand node(ClosureExpr *expr);
+    template <class Op>
+    ClosureOperand binary(const Expression &left, const Expression &right);
+    ClosureOperand call(const string &name, const vector<Expression *> &args, const NativeFunction *native);
+
+    ClosureStmt &emit(ClosureStmt::Exec exec, int lineno);
+    int target(int skiprows) const;
+    const ClosureFunction *function(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure);
+};
+
+
+class ClosureEngine {
+private:
+    map<string, const ClosureFunction *> bindings;
+    vector<ClosureFunction *> functions;    // every compiled body, owned here like the nodes and calls
+    vector<ClosureExpr *> nodes;
+    vector<ClosureCall *> calls;
+    int maxDepth;
+    size_t memoSize;
+    int depth;
+    const char *stackBase;                  // native stack use is measured from here
+    size_t stackLimit;
+    int errorLine;                          // statement that raised the error being unwound
+    Tracer *tracer;
+    Stats *stats;
+    const ClosureFunction *main;
+    Arena *heap;                            // of the caller, for the strings made on the engine's own thread
+    bool failed;
+
+    int execute(const ClosureFunction *fn, ClosureFrame &frame);
+    void runMain();
+    static void *start(void *engine);
+
+public:
+    ostream *out;
+    unsigned version;                       // bumped whenever a function is defined
+    const ClosureFunction *tailCallee;      // left by a tail call for invoke() to continue with
+    vector<MyObject> tailArgs;
+
+    ClosureEngine(int maxDepth, size_t memoSize, Tracer *tracer, Stats *stats, ostream *out);
+    ~ClosureEngine();
+
+    ClosureFunction *newFunction(const string &name, int nparams, int nslots, bool pure);
+    ClosureExpr *newNode();
+    ClosureCall *newCall(const string &name);
+
+    void define(const ClosureFunction *fn);
+    const ClosureFunction *link(const ClosureCall *call);
+    MyObject invoke(const ClosureFunction *fn, const MyObject *args);
+    MyObject invokeNative(const NativeFunction *fn, const MyObject *args, int nargs);
+    bool run(const ClosureFunction *main);
+    void report(ostream &out) const;
+};
+
+
+#endif /* H_CLOSURE */
@@ -6,17 +6,20 @@
 #include <stdio.h>
 #include <map>
 #include "interpreter.hpp"
+#include "parser.hpp"
 using namespace std;
 
 
-struct LexType {
-    string name;
+// One word per value on the parser stack. The lists are built in place and
+// handed from one reduction to the next; whichever action uses one up frees it.
+union LexType {
+    int name;                   // id in the symbols of the program
+    MyObject value;
     Expression *expr;
-    MyObject *value;
     Statement *stmt;
-    vector<Statement *> stmts;
-    vector<string> argNames;
-    vector<Expression *> argValues;
+    vector<Statement *> *stmts;
+    vector<string> *argNames;
+    vector<Expression *> *argValues;
 };
 
 
@@ -0,0 +1,451 @@
+#include "compiler.hpp"
+#include <stdint.h>
+
+
+// Temporaries are numbered from here while a function is being compiled,
+// because the number of named variables is only known once it is done.
+#define TEMP_BASE (1 << 28)
+
+// Definite assignment analysis is skipped (keeping every check) beyond this many bits of state
+#define MAX_ANALYSIS_BITS (1 << 26)
+
+
+Compiler::Compiler(Module *module) : module(module), code(NULL), nlocals(0), ntemps(0), maxTemps(0), current(0), lineno(0) {}
+
+
+int Compiler::compile(const string &name, int nparams, int nslots, const vector<Statement *> &codes) {
+    int index = module->functions.size();
+    code = new FunctionCode(name, nparams);
+    module->functions.push_back(code);
+    nlocals = nslots;
+
+    int N = codes.size();
+    for (current = 0; current < N; current++) {
+        Statement *stmt = codes[current];
+        starts.push_back(code->code.size());
+        lineno = stmt->lineno;
+        int m = mark();
+        stmt->compile(*this);
+        release(m);
+    }
+    starts.push_back(code->code.size());
+
+    // Falling off the end of a body returns 0
+    int r = temp();
+    emit(OP_LOADI, r, 0);
+    emit(OP_RET, r);
+
+    finish();
+    return index;
+}
+
+
+int Compiler::emit(Opcode op, int a, int b, int c) {
+    Instruction inst;
+    inst.op = op;
+    inst.a = a;
+    inst.b = b;
+    inst.c = c;
+    code->code.push_back(inst);
+    code->lines.push_back(lineno);
+    return code->code.size() - 1;
+}
+
+
+int Compiler::name(const string &name) {
+    return module->name(name);
+}
+
+int Compiler::native(const NativeFunction *fn) {
+    return module->native(fn);
+}
+
+int Compiler::constant(MyObject value) {
+    code->constants.push_back(value);
+    return code->constants.size() - 1;
+}
+
+
+int Compiler::temp() {
+    int reg = TEMP_BASE + ntemps++;
+    if (ntemps > maxTemps)
+        maxTemps = ntemps;
+    return reg;
+}
+
+
+int Compiler::mark() const {
+    return ntemps;
+}
+
+
+void Compiler::release(int mark) {
+    ntemps = mark;
+}
+
+
+int Compiler::binary(Opcode op, Opcode opImmediate, const Expression &left, const Expression &right, int target) {
+    int m = mark();
+    int l = left.compile(*this, -1);
+    const Literal *literal = dynamic_cast<const Literal *>(&right);
+    if (literal && literal->getValue().isInt()) {
+        release(m);
+        int d = target >= 0 ? target : temp();
+        emit(opImmediate, d, l, literal->getValue().getInt());
+        return d;
+    }
+    int r = right.compile(*this, -1);
+    release(m);
+    int d = target >= 0 ? target : temp();
+    emit(op, d, l, r);
+    return d;
+}
+
+
+int Compiler::logical(bool isAnd, const Expression &left, const Expression &right, int target) {
+    int m = mark();
+    int l = left.compile(*this, -1);
+    release(m);
+    int d = target >= 0 ? target : temp();
+    int m2 = mark();
+
+    // The short-circuit result is only written once the right side can no longer read it
+    int skip = emit(isAnd ? OP_JMPT : OP_JMPF, l);
+    emit(OP_LOADI, d, isAnd ? 0 : 1);
+    int done = emit(OP_JMP);
+    code->code[skip].b = code->code.size();
+    int r = right.compile(*this, -1);
+    emit(OP_MOVE, d, r);
+    code->code[done].b = code->code.size();
+    release(m2);
+    return d;
+}
+
+
+// The compare-and-branch doing what op followed by a JMPT on its result does, NOP if there is none
+static Opcode compareJump(unsigned op) {
+    if (op >= OP_GT && op <= OP_EQ)
+        return (Opcode)(OP_JGT + (op - OP_GT));
+    if (op >= OP_GTI && op <= OP_EQI)
+        return (Opcode)(OP_JGTI + (op - OP_GTI));
+    return OP_NOP;
+}
+
+
+// A comparison into a temporary read by nothing but the jump becomes part of it
+void Compiler::jump(Opcode op, int reg, int skiprows) {
+    Instruction *last = code->code.empty() ? NULL : &code->code.back();
+    int inst;
+    if (op == OP_JMPT && reg >= TEMP_BASE && last && last->a == reg && compareJump(last->op) != OP_NOP) {
+        last->op = compareJump(last->op);
+        last->a = last->b;
+        inst = code->code.size() - 1;
+    } else {
+        inst = emit(op, reg);
+    }
+    jumps.push_back(make_pair(inst, current + skiprows + 1));
+}
+
+
+int Compiler::function(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure) {
+    Compiler compiler(module);
+    int index = compiler.compile(name, nparams, nslots, codes);
+    module->functions[index]->pure = pure;
+    return index;
+}
+
+
+void Compiler::finish() {
+    int N = starts.size() - 1;
+    for (vector<pair<int, int> >::iterator iter = jumps.begin(); iter != jumps.end(); iter++) {
+        int target = iter->second;
+        if (target < 0)
+            target = 0;
+        if (target > N)
+            target = N;
+        code->code[iter->first].b = starts[target];
+    }
+    renumberTemps();
+    removeChecks();
+}
+
+
+void Compiler::renumberTemps() {
+    for (vector<Instruction>::iterator iter = code->code.begin(); iter != code->code.end(); iter++) {
+        for (int i = 0; i < 3; i++) {
+            OperandKind kind = iter->kind(i);
+            if ((kind == OPERAND_READ || kind == OPERAND_WRITE || kind == OPERAND_BASE) && iter->operand(i) >= TEMP_BASE)
+                iter->operand(i) += nlocals - TEMP_BASE;
+        }
+    }
+    code->nregs = nlocals + maxTemps;
+}
+
+
+static bool isJump(const Instruction &inst) {
+    return inst.kind(1) == OPERAND_JUMP;
+}
+
+
+// Every variable read is preceded by a CHKDEF. A forward "definitely assigned" analysis
+// over the basic blocks drops the checks that can never fail; variables that still need
+// one get a flag register which is set after every write to the variable. The flags sit
+// right after the locals, below the temporaries, which a call's window may start at.
+void Compiler::removeChecks() {
+    vector<Instruction> &insts = code->code;
+    int n = insts.size();
+    int words = (nlocals + 63) / 64;
+
+    // Split into basic blocks
+    vector<bool> leader(n + 1, false);
+    leader[0] = true;
+    for (int i = 0; i < n; i++) {
+        if (isJump(insts[i]))
+            leader[insts[i].b] = true;
+        if (isJump(insts[i]) || insts[i].op == OP_RET)
+            leader[i + 1] = true;
+    }
+    vector<int> blockStart, blockOf(n);
+    for (int i = 0; i < n; i++) {
+        if (leader[i])
+            blockStart.push_back(i);
+        blockOf[i] = blockStart.size() - 1;
+    }
+    int nblocks = blockStart.size();
+    blockStart.push_back(n);
+
+    vector<bool> checked(nlocals, false);
+    vector<bool> keep(n, true);
+
+    if ((int64_t)nblocks * words * 64 * 2 > MAX_ANALYSIS_BITS) {
+        for (int i = 0; i < n; i++) {
+            if (insts[i].op == OP_CHKDEF)
+                checked[insts[i].a] = true;
+        }
+    } else {
+        vector<uint64_t> in(nblocks * words, ~(uint64_t)0), out(nblocks * words, ~(uint64_t)0);
+        vector<vector<int> > preds(nblocks);
+        for (int blk = 0; blk < nblocks; blk++) {
+            const Instruction &last = insts[blockStart[blk + 1] - 1];
+            if (isJump(last))
+                preds[blockOf[last.b < n ? last.b : n - 1]].push_back(blk);
+            if (last.op != OP_JMP && last.op != OP_RET && blockStart[blk + 1] < n)
+                preds[blk + 1].push_back(blk);
+        }
+        vector<uint64_t> entry(words, 0);
+        for (int i = 0; i < code->nparams; i++) {
+            entry[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int blk = 0; blk < nblocks; blk++) {
+                uint64_t *blkIn = &in[blk * words], *blkOut = &out[blk * words];
+                for (int w = 0; w < words; w++) {
+                    uint64_t bits = blk == 0 ? entry[w] : ~(uint64_t)0;
+                    for (vector<int>::iterator p = preds[blk].begin(); p != preds[blk].end(); p++) {
+                        bits &= out[*p * words + w];
+                    }
+                    blkIn[w] = bits;
+                }
+                vector<uint64_t> bits(blkIn, blkIn + words);
+                for (int i = blockStart[blk]; i < blockStart[blk + 1]; i++) {
+                    if (insts[i].kind(0) == OPERAND_WRITE && insts[i].a < nlocals)
+                        bits[insts[i].a / 64] |= (uint64_t)1 << (insts[i].a % 64);
+                }
+                for (int w = 0; w < words; w++) {
+                    if (blkOut[w] != bits[w]) {
+                        blkOut[w] = bits[w];
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        for (int blk = 0; blk < nblocks; blk++) {
+            vector<uint64_t> bits(&in[blk * words], &in[blk * words] + words);
+            for (int i = blockStart[blk]; i < blockStart[blk + 1]; i++) {
+                const Instruction &inst = insts[i];
+                if (inst.op == OP_CHKDEF) {
+                    if (bits[inst.a / 64] & ((uint64_t)1 << (inst.a % 64)))
+                        keep[i] = false;
+                    else
+                        checked[inst.a] = true;
+                }
+                if (inst.kind(0) == OPERAND_WRITE && inst.a < nlocals)
+                    bits[inst.a / 64] |= (uint64_t)1 << (inst.a % 64);
+            }
+        }
+    }
+
+    map<int, int> flags;
+    int nflags = 0;
+    for (int r = 0; r < nlocals; r++) {
+        if (checked[r])
+            flags[r] = nlocals + nflags++;
+    }
+    code->nregs += nflags;
+
+    // Rebuild the code without the dropped checks and with the flag updates
+    vector<Instruction> result;
+    vector<int> lines;
+    vector<int> newIndex(n + 1);
+    for (int i = 0; i < n; i++) {
+        newIndex[i] = result.size();
+        if (!keep[i])
+            continue;
+        Instruction inst = insts[i];
+        for (int k = 0; k < 3; k++) {
+            OperandKind kind = inst.kind(k);
+            if ((kind == OPERAND_READ || kind == OPERAND_WRITE || kind == OPERAND_BASE) && inst.operand(k) >= nlocals)
+                inst.operand(k) += nflags;
+        }
+        if (inst.op == OP_CHKDEF)
+            inst.a = flags[inst.a];
+        result.push_back(inst);
+        lines.push_back(code->lines[i]);
+        if (inst.kind(0) == OPERAND_WRITE && flags.count(inst.a)) {
+            Instruction set;
+            set.op = OP_LOADI;
+            set.a = flags[inst.a];
+            set.b = 1;
+            set.c = 0;
+            result.push_back(set);
+            lines.push_back(code->lines[i]);
+        }
+    }
+    newIndex[n] = result.size();
+    for (vector<Instruction>::iterator iter = result.begin(); iter != result.end(); iter++) {
+        if (isJump(*iter))
+            iter->b = newIndex[iter->b];
+    }
+    code->code.swap(result);
+    code->lines.swap(lines);
+}
+
+
+int Plus::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_ADD, OP_ADDI, left, right, target);
+}
+
+int Minus::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_SUB, OP_SUBI, left, right, target);
+}
+
+int Times::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_MUL, OP_MULI, left, right, target);
+}
+
+int Divide::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_DIV, OP_DIVI, left, right, target);
+}
+
+int GreaterThan::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_GT, OP_GTI, left, right, target);
+}
+
+int LessThan::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_LT, OP_LTI, left, right, target);
+}
+
+int GreaterEqual::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_GE, OP_GEI, left, right, target);
+}
+
+int LessEqual::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_LE, OP_LEI, left, right, target);
+}
+
+int Equal::compile(Compiler &compiler, int target) const {
+    return compiler.binary(OP_EQ, OP_EQI, left, right, target);
+}
+
+int LogicalAnd::compile(Compiler &compiler, int target) const {
+    return compiler.logical(true, left, right, target);
+}
+
+int LogicalOr::compile(Compiler &compiler, int target) const {
+    return compiler.logical(false, left, right, target);
+}
+
+
+int Literal::compile(Compiler &compiler, int target) const {
+    int d = target >= 0 ? target : compiler.temp();
+    if (value.isInt())
+        compiler.emit(OP_LOADI, d, value.getInt());
+    else
+        compiler.emit(OP_LOADK, d, compiler.constant(value));
+    return d;
+}
+
+
+int Variable::compile(Compiler &compiler, int target) const {
+    compiler.emit(OP_CHKDEF, slot, compiler.name(name));
+    if (target >= 0 && target != slot) {
+        compiler.emit(OP_MOVE, target, slot);
+        return target;
+    }
+    return slot;
+}
+
+
+int Call::compile(Compiler &compiler, int target) const {
+    int m = compiler.mark();
+    int N = args.size();
+    int base = compiler.temp();
+    for (int i = 1; i < N; i++) {
+        compiler.temp();
+    }
+    for (int i = 0; i < N; i++) {
+        args[i]->compile(compiler, base + i);
+    }
+    if (native)
+        compiler.emit(OP_NATIVE, base, compiler.native(native), N);
+    else
+        compiler.emit(tail ? OP_TCALL : OP_CALL, base, compiler.name(name), N);
+    compiler.release(m);
+    if (target >= 0) {
+        compiler.emit(OP_MOVE, target, base);
+        return target;
+    }
+    return compiler.temp();
+}
+
+
+void If::compile(Compiler &compiler) const {
+    int reg = condition->compile(compiler, -1);
+    compiler.jump(OP_JMPF, reg, skiprows);
+}
+
+
+void Jump::compile(Compiler &compiler) const {
+    compiler.jump(OP_JMP, 0, skiprows);
+}
+
+
+void Loop::compile(Compiler &compiler) const {
+    int reg = condition->compile(compiler, -1);
+    compiler.jump(OP_JMPT, reg, skiprows);
+}
+
+
+void Assignment::compile(Compiler &compiler) const {
+    expr->compile(compiler, slot);
+}
+
+
+void Function::compile(Compiler &compiler) const {
+    int index = compiler.function(name, arguments.size(), nslots, statements, pure);
+    compiler.emit(OP_DEFUN, compiler.name(name), index);
+}
+
+
+void Print::compile(Compiler &compiler) const {
+    compiler.emit(OP_PRINT, expr->compile(compiler, -1));
+}
+
+
+void Return::compile(Compiler &compiler) const {
+    compiler.emit(OP_RET, expr->compile(compiler, -1));
+}
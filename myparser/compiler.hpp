@@ -0,0 +1,49 @@
+#ifndef H_COMPILER
+#define H_COMPILER
+
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+#include "bytecode.hpp"
+using namespace std;
+
+
+// Lowers the statements of one function body into register bytecode.
+// Every variable slot assigned by the resolver owns a register; temporaries are stacked above them.
+class Compiler {
+private:
+    Module *module;
+    FunctionCode *code;
+    int nlocals;
+    int ntemps;
+    int maxTemps;
+    int current;                        // index of the statement being compiled
+    int lineno;
+    vector<int> starts;                 // first instruction of each statement
+    vector<pair<int, int> > jumps;      // (instruction, target statement) pairs to patch
+
+    void finish();
+    void renumberTemps();
+    void removeChecks();
+
+public:
+    Compiler(Module *module);
+
+    int compile(const string &name, int nparams, int nslots, const vector<Statement *> &codes);
+
+    int emit(Opcode op, int a = 0, int b = 0, int c = 0);
+    int name(const string &name);
+    int native(const NativeFunction *fn);
+    int constant(MyObject value);
+    int temp();
+    int mark() const;
+    void release(int mark);
+
+    int binary(Opcode op, Opcode opImmediate, const Expression &left, const Expression &right, int target);
+    int logical(bool isAnd, const Expression &left, const Expression &right, int target);
+    void jump(Opcode op, int reg, int skiprows);
+    int function(const string &name, int nparams, int nslots, const vector<Statement *> &codes, bool pure);
+};
+
+
+#endif /* H_COMPILER */
@@ -1,21 +1,18 @@
 #include "interpreter.hpp"
+#include "closure.hpp"
+#include "compiler.hpp"
+#include "library.hpp"
+#include "memo.hpp"
+#include "natives.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "profiler.hpp"
+#include "resolver.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <iomanip>
 #include <sstream>
-
-
-#ifdef DEBUG
-#define cdbg cout
-#else
-stringstream _nouse;
-#define cdbg _nouse
-#endif
-
-#ifndef assert
-#ifdef DEBUG
-#define assert(cond) if(!(cond)) cdbg << "Assertion failed" << endl
-#else
-#define assert(cond)
-#endif /* DEBUG */
-#endif /* assert */
+#include <sys/resource.h>
 
 
 StringException::StringException(string msg) throw () : msg(msg) {}
@@ -38,70 +35,47 @@ T Nullable<T>::get() const {
 }
 
 
-Environment::Environment(const vector<Statement *> &codes, map<string, MyObject> variables, const int id)
-  : lineno(0), codes(codes.begin(), codes.end()), id(id), retSlot(0), variables(variables.begin(), variables.end()) {
+Environment::Environment(const vector<Statement *> *codes, size_t offset, int nslots, const int id, size_t base, Stats *stats)
+  : variables(NULL), defined(NULL), offset(offset), nslots(nslots), codes(codes), lineno(0), id(id), base(base), memo(NULL), stats(stats) {
 }
 
 
-bool Environment::hasCache(unsigned long expr) const {
-    auto iter = callCache.find(expr);
-    return (iter != callCache.end());
+void Environment::bind(MyObject *slots, char *defined) {
+    this->variables = slots + offset;
+    this->defined = defined + offset;
 }
 
 
-MyObject Environment::getCache(unsigned long expr) const {
-    auto iter = callCache.find(expr);
-    return iter->second;
-}
-
-void Environment::setCache(unsigned long expr, MyObject obj) {
-    callCache[expr] = obj;
-}
-
-void Environment::clearCache() {
-    callCache.clear();
-}
-
-
-void Environment::setRetSlot(unsigned long caller) {
-    retSlot = caller;
-}
-
-
-unsigned long Environment::getRetSlot() const {
-    return retSlot;
+size_t Environment::getOffset() const {
+    return offset;
 }
 
 
 Statement *Environment::getCode(int i) const {
-    return codes[i];
-}
-
-void Environment::retn(unsigned long caller, const MyObject value) {
-    setCache(caller, value);
+    return (*codes)[i];
 }
 
 void Environment::print() const {
     cout << "Output Environment" << endl;
-    for (map<string, MyObject>::const_iterator iter = variables.begin(); iter != variables.end(); iter++) {
-        string name = iter->first;
-        MyObject value = iter->second;
-        cout << name << " : " << value << endl;
+    for (int i = 0; i < nslots; i++) {
+        if (defined[i])
+            cout << "slot " << i << " : " << variables[i] << endl;
     }
     cout << "==================" << endl;
 }
 
-Nullable<MyObject> Environment::get(string name) const {
-    map<string, MyObject>::const_iterator iter = variables.find(name);
-    if (iter == variables.end()) {
+Nullable<MyObject> Environment::get(int slot) const {
+    stats->variableLookups++;
+    if (!defined[slot]) {
         return Nullable<MyObject>();
     } else {
-        return Nullable<MyObject>(iter->second);
+        return Nullable<MyObject>(variables[slot]);
     }
 }
 
-void Environment::set(string name, int value) {
-    variables[name] = value;
+void Environment::set(int slot, MyObject value) {
+    variables[slot] = value;
+    defined[slot] = true;
 }
 int Environment::getLineno() const {
     return lineno;
@@ -111,6 +85,26 @@ int Environment::getId() const {
     return id;
 }
 
+size_t Environment::getBase() const {
+    return base;
+}
+
+MemoTable *Environment::getMemo() const {
+    return memo;
+}
+
+void Environment::setMemo(MemoTable *memo) {
+    this->memo = memo;
+}
+
+Stats *Environment::getStats() const {
+    return stats;
+}
+
+int Environment::size() const {
+    return codes->size();
+}
+
 
 void Environment::jmp(int lines) {
     int lineno_before = lineno;
@@ -124,15 +118,41 @@ void Environment::nextLine() {
 }
 
 
-BinaryOp::BinaryOp (const Expression &left, const Expression &right) : left(left), right(right) {}
+Expression::Expression(bool hasCall) : hasCall(hasCall) {}
+
+void Expression::step(Interpreter &interpreter, int state) const {
+    interpreter.push(evaluate(interpreter.getEnv()));
+}
+
+
+BinaryOp::BinaryOp (const Expression &left, const Expression &right)
+    : Expression(left.hasCall || right.hasCall), left(left), right(right) {}
+
+void BinaryOp::step(Interpreter &interpreter, int state) const {
+    switch (state) {
+    case 0:
+        interpreter.suspend(this, 1);
+        interpreter.schedule(&left);
+        break;
+    case 1:
+        interpreter.suspend(this, 2);
+        interpreter.schedule(&right);
+        break;
+    default:
+        MyObject rightValue = interpreter.pop();
+        MyObject leftValue = interpreter.pop();
+        interpreter.push(apply(leftValue, rightValue));
+    }
+}
 
 Plus::Plus (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool Plus::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue + rightValue;
-    return true;
+MyObject Plus::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return Plus::apply(leftValue, right.evaluate(env));
+}
+
+MyObject Plus::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectAdd(leftValue, rightValue);
 }
 
 string Plus::toString() const {
@@ -141,12 +161,13 @@ string Plus::toString() const {
 
 
 Minus::Minus (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool Minus::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue - rightValue;
-    return true;
+MyObject Minus::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return Minus::apply(leftValue, right.evaluate(env));
+}
+
+MyObject Minus::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectSubtract(leftValue, rightValue);
 }
 
 string Minus::toString() const {
@@ -155,12 +176,13 @@ string Minus::toString() const {
 
 
 Times::Times (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool Times::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue * rightValue;
-    return true;
+MyObject Times::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return Times::apply(leftValue, right.evaluate(env));
+}
+
+MyObject Times::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectMultiply(leftValue, rightValue);
 }
 
 string Times::toString() const {
@@ -168,12 +190,13 @@ string Times::toString() const {
 }
 
 Divide::Divide (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool Divide::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue / rightValue;
-    return true;
+MyObject Divide::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return Divide::apply(leftValue, right.evaluate(env));
+}
+
+MyObject Divide::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectDivide(leftValue, rightValue);
 }
 
 string Divide::toString() const {
@@ -182,12 +205,13 @@ string Divide::toString() const {
 
 
 GreaterThan::GreaterThan (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool GreaterThan::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue > rightValue;
-    return true;
+MyObject GreaterThan::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return GreaterThan::apply(leftValue, right.evaluate(env));
+}
+
+MyObject GreaterThan::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectGreater(leftValue, rightValue);
 }
 
 string GreaterThan::toString() const {
@@ -196,12 +220,13 @@ string GreaterThan::toString() const {
 
 
 LessThan::LessThan (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool LessThan::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue < rightValue;
-    return true;
+MyObject LessThan::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return LessThan::apply(leftValue, right.evaluate(env));
+}
+
+MyObject LessThan::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectLess(leftValue, rightValue);
 }
 
 string LessThan::toString() const {
@@ -210,12 +235,13 @@ string LessThan::toString() const {
 
 
 GreaterEqual::GreaterEqual (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool GreaterEqual::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue >= rightValue;
-    return true;
+MyObject GreaterEqual::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return GreaterEqual::apply(leftValue, right.evaluate(env));
+}
+
+MyObject GreaterEqual::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectGreaterEqual(leftValue, rightValue);
 }
 
 string GreaterEqual::toString() const {
@@ -224,12 +250,13 @@ string GreaterEqual::toString() const {
 
 
 LessEqual::LessEqual (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool LessEqual::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue <= rightValue;
-    return true;
+MyObject LessEqual::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return LessEqual::apply(leftValue, right.evaluate(env));
+}
+
+MyObject LessEqual::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectLessEqual(leftValue, rightValue);
 }
 
 string LessEqual::toString() const {
@@ -238,12 +265,13 @@ string LessEqual::toString() const {
 
 
 Equal::Equal (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool Equal::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!(left.evaluate(env, &leftValue) && right.evaluate(env, &rightValue)))
-        return false;
-    *ret = leftValue == rightValue;
-    return true;
+MyObject Equal::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    return Equal::apply(leftValue, right.evaluate(env));
+}
+
+MyObject Equal::apply(MyObject leftValue, MyObject rightValue) const {
+    return objectEqual(leftValue, rightValue);
 }
 
 string Equal::toString() const {
@@ -252,20 +280,26 @@ string Equal::toString() const {
 
 
 LogicalOr::LogicalOr (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool LogicalOr::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!left.evaluate(env, &leftValue))
-        return false;
-    if (leftValue) {
-        *ret = true;
+MyObject LogicalOr::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    if (leftValue.truthy())
         return true;
-    }
+    return right.evaluate(env);
+}
 
-    if(!right.evaluate(env, &rightValue))
-        return false;
-    
-    *ret = rightValue;
-    return true;
+MyObject LogicalOr::apply(MyObject leftValue, MyObject rightValue) const {
+    return leftValue.truthy() ? true : rightValue;
+}
+
+void LogicalOr::step(Interpreter &interpreter, int state) const {
+    if (state == 0) {
+        interpreter.suspend(this, 1);
+        interpreter.schedule(&left);
+    } else if (interpreter.pop().truthy()) {
+        interpreter.push(true);
+    } else {
+        interpreter.schedule(&right);
+    }
 }
 
 string LogicalOr::toString() const {
@@ -274,20 +308,26 @@ string LogicalOr::toString() const {
 
 
 LogicalAnd::LogicalAnd (const Expression &left, const Expression &right) : BinaryOp(left, right) {}
-bool LogicalAnd::evaluate(Environment const *env, MyObject *ret) const {
-    MyObject leftValue, rightValue;
-    if(!left.evaluate(env, &leftValue))
+MyObject LogicalAnd::evaluate(Environment const *env) const {
+    MyObject leftValue = left.evaluate(env);
+    if (!leftValue.truthy())
         return false;
-    if (!leftValue) {
-        *ret = false;
-        return true;
-    }
+    return right.evaluate(env);
+}
 
-    if(!right.evaluate(env, &rightValue))
-        return false;
-    
-    *ret = rightValue;
-    return true;
+MyObject LogicalAnd::apply(MyObject leftValue, MyObject rightValue) const {
+    return leftValue.truthy() ? rightValue : false;
+}
+
+void LogicalAnd::step(Interpreter &interpreter, int state) const {
+    if (state == 0) {
+        interpreter.suspend(this, 1);
+        interpreter.schedule(&left);
+    } else if (!interpreter.pop().truthy()) {
+        interpreter.push(false);
+    } else {
+        interpreter.schedule(&right);
+    }
 }
 
 string LogicalAnd::toString() const {
@@ -295,26 +335,32 @@ string LogicalAnd::toString() const {
 }
 
 
-Literal::Literal(const MyObject &value) : value(value) {}
-bool Literal::evaluate(Environment const *env, MyObject *ret) const {
-    *ret = value;
-    return true;
+Literal::Literal(const MyObject &value) : Expression(false), value(value) {}
+MyObject Literal::getValue() const {
+    return value;
+}
+
+MyObject Literal::evaluate(Environment const *env) const {
+    return value;
 }
 
 string Literal::toString() const {
-    return to_string(value);
+    stringstream ss;
+    if (value.isString())
+        ss << '"' << value << '"';
+    else
+        ss << value;
+    return ss.str();
 }
 
 
-Variable::Variable(const string &name) : name(name) {}
-bool Variable::evaluate(Environment const *env, MyObject *ret) const {
-    Nullable<MyObject> const retn = env->get(name);
+Variable::Variable(const string &name) : Expression(false), name(name), slot(-1) {}
+MyObject Variable::evaluate(Environment const *env) const {
+    Nullable<MyObject> const retn = env->get(slot);
     if (retn.isNull()) {
         throw StringException("Variable not found: " + name);
-    } else {
-        *ret = retn.get();
     }
-    return true;
+    return retn.get();
 }
 
 string Variable::toString() const {
@@ -322,21 +368,82 @@ string Variable::toString() const {
 }
 
 
-Call::Call(string name, const vector<Expression *> &args) : name(name), args(args) {}
-bool Call::evaluate(Environment const *env, MyObject *ret) const {
-    if (env->hasCache((unsigned long)this)) {
-        *ret = env->getCache((unsigned long)this);
-        return true;
+Call::Call(const string &name, const vector<Expression *> &args)
+    : Expression(true), name(name), args(args), callee(NULL), version(0), tail(false), native(NULL) {}
+
+const string &Call::getName() const {
+    return name;
+}
+
+bool Call::isTail() const {
+    return tail;
+}
+
+void Call::setTail(bool tail) const {
+    this->tail = tail;
+}
+
+const NativeFunction *Call::getNative() const {
+    return native;
+}
+
+// Only a native whose arguments make no calls gets here, see Call::resolve
+MyObject Call::evaluate(Environment const *env) const {
+    if (!native)
+        throw StringException("Call to " + name + " must go through the continuation stack");
+    int N = args.size();
+    MyObject small[CALL_SMALL_ARGS];
+    vector<MyObject> large;
+    MyObject *values = small;
+    if (N > CALL_SMALL_ARGS) {
+        large.resize(N);
+        values = large.data();
+    }
+    for (int i = 0; i < N; i++) {
+        values[i] = args[i]->evaluate(env);
+    }
+    env->getStats()->calls++;
+    return callNative(native, values, N);
+}
+
+// Evaluates the arguments one per state, then enters the callee. Its
+// return value is pushed for whatever continuation is waiting below.
+void Call::step(Interpreter &interpreter, int state) const {
+    int N = args.size();
+    if (state < N) {
+        interpreter.suspend(this, state + 1);
+        interpreter.schedule(args[state]);
+        return;
+    }
+    if (native) {
+        interpreter.callNative(native, N);
+        return;
+    }
+    const FunctionDefinition *fn = version == interpreter.getVersion() ? callee : lookup(interpreter);
+    if (tail) {
+        interpreter.tailCall(fn, N);
     } else {
-        Interpreter &interpreter = getInterpreter();   // This is cheat!
-        if(!interpreter.hasFunction(name)) {
-            throw StringException("Cannot find function " + name);
-        }
-        interpreter.callFunction(name, args, (unsigned long)this);
-        return false;
+        interpreter.callFunction(fn, N);
     }
 }
 
+// Resolves the callee and checks the arity once; the result stays cached
+// until another function gets registered.
+const FunctionDefinition *Call::lookup(Interpreter &interpreter) const {
+    const FunctionDefinition *fn = interpreter.findFunction(name);
+    if (fn == NULL) {
+        throw StringException("Cannot find function " + name);
+    }
+    if (fn->arity != (int)args.size()) {
+        stringstream ss;
+        ss << "Function " << name << " takes " << fn->arity << " arguments, " << args.size() << " given";
+        throw StringException(ss.str());
+    }
+    callee = fn;
+    version = interpreter.getVersion();
+    return fn;
+}
+
 
 string Call::toString() const {
     stringstream ss;
@@ -349,82 +456,236 @@ string Call::toString() const {
 }
 
 
-Interpreter::Interpreter() {
+FunctionDefinition::FunctionDefinition(const string &name, int arity, int nslots, const vector<Statement *> *statements, MemoTable *memo)
+    : name(name), arity(arity), nslots(nslots), statements(statements), memo(memo) {}
+
+FunctionDefinition::~FunctionDefinition() {
+    delete memo;
 }
 
-Environment *Interpreter::getEnv() {
-    return env;
+Interpreter::Interpreter() : slotTop(0), maxDepth(DEFAULT_MAX_DEPTH), version(1), env(NULL), arena(NULL), symbols(NULL), engine(ENGINE_VM),
+    optLevel(DEFAULT_OPT_LEVEL), tailCalls(true), memoSize(0), memoStats(false), jit(true), jitDump(false),
+    bench(false), started(chrono::steady_clock::now()), statsFormat(STATS_NONE), profiler(NULL), natives(new Natives()), out(&cout), err(&cerr) {
+    addLibrary(*natives);
 }
 
-void Interpreter::pushCode(Statement *stmt) {
-    codes.push_back(stmt);
+Interpreter::~Interpreter() {
+    delete profiler;
+    delete natives;
+    for (auto iter = functions.begin(); iter != functions.end(); iter++) {
+        delete iter->second;
+    }
 }
 
-void Interpreter::setVariable(string name, MyObject value) {
-    env->set(name, value);
+void Interpreter::setEngine(Engine engine) {
+    this->engine = engine;
 }
 
-MyObject Interpreter::getVariable(string name) {
-    Nullable<MyObject> ret = env->get(name);
-    if (ret.isNull()) {
-        throw StringException("Variable not found: " + name);
-        return MyObject();
-    } else {
-        return ret.get();
-    }
+void Interpreter::setOptLevel(int level) {
+    this->optLevel = level;
+}
+
+void Interpreter::setTailCalls(bool enabled) {
+    this->tailCalls = enabled;
+}
+
+void Interpreter::setMemoSize(size_t size) {
+    this->memoSize = size;
+}
+
+// Reporting turns memoization on unless a size was chosen
+void Interpreter::setMemoStats(bool enabled) {
+    this->memoStats = enabled;
+    if (enabled && memoSize == 0)
+        memoSize = DEFAULT_MEMO_SIZE;
+}
+
+void Interpreter::setJit(bool enabled) {
+    this->jit = enabled;
+}
+
+void Interpreter::setJitDump(bool enabled) {
+    this->jitDump = enabled;
+}
+
+void Interpreter::setBench(bool enabled) {
+    this->bench = enabled;
+}
+
+void Interpreter::setStats(StatsFormat format) {
+    this->statsFormat = format;
+}
+
+void Interpreter::setProfile(const string &path) {
+    delete profiler;
+    profiler = new Profiler(path);
+}
+
+Tracer &Interpreter::getTracer() {
+    return tracer;
+}
+
+Natives &Interpreter::getNatives() {
+    return *natives;
+}
+
+// Set before the options, so that --trace-file still wins over err
+void Interpreter::setOutput(ostream *out, ostream *err) {
+    this->out = out;
+    this->err = err;
+    tracer.setStream(err);
+}
+
+void Interpreter::setMaxDepth(int maxDepth) {
+    this->maxDepth = maxDepth;
+}
+
+Environment *Interpreter::getEnv() {
+    return env;
+}
+
+void Interpreter::load(Program *program) {
+    codes.insert(codes.end(), program->statements.begin(), program->statements.end());
+    arena = &program->arena;
+    symbols = &program->symbols;
+    stats.astBytes += arena->getBytes();
 }
 
-bool Interpreter::registerFunction(const string &name, const vector<string> &args, const vector<Statement *> &body) {
+void Interpreter::setVariable(int slot, MyObject value) {
+    env->set(slot, value);
+}
+
+bool Interpreter::registerFunction(const string &name, const vector<string> &args, const vector<Statement *> &body, int nslots, bool pure) {
     auto iter = functions.find(name);
     if (iter == functions.end()) {
-        functions[name] = pair<vector<string>, vector<Statement *>>(args, body);
-        
+        MemoTable *memo = pure && memoSize > 0 ? new MemoTable(name, args.size(), memoSize) : NULL;
+        functions[name] = new FunctionDefinition(name, args.size(), nslots, &body, memo);
+        version++;
         return true;
     } else {
         return false;
     }
 }
 
-bool Interpreter::hasFunction(const string &name) {
-    return functions.find(name) != functions.end();
+const FunctionDefinition *Interpreter::findFunction(const string &name) {
+    stats.cacheMisses++;
+    auto iter = functions.find(name);
+    return iter == functions.end() ? NULL : iter->second;
 }
 
-bool Interpreter::callFunction(const string &name, const vector<Expression *> arguments, unsigned long caller) {
-    auto iter = functions.find(name);
-    const auto fn = iter->second;
-    const vector<string> &argNames = fn.first;
-    vector<Statement *> codes = fn.second;
-    map<string, MyObject> bindings;
-    assert(argNames.size() == arguments.size());
-    int N = arguments.size();
-    for (int i = 0; i < N; i++){
-        const string &name = argNames[i];
-        MyObject obj;
-        if (!arguments[i]->evaluate(env, &obj))
-            return false;
-        bindings[name] = obj;
-    }
-    pushd(codes, bindings);
-    env->setRetSlot(caller);
-    return true;
+unsigned Interpreter::getVersion() const {
+    return version;
+}
+
+void Interpreter::callFunction(const FunctionDefinition *fn, int nargs) {
+    stats.calls++;
+    TRACE(tracer, TRACE_CALL, "call " << fn->name << traceArgs(&operands[operands.size() - nargs], nargs));
+    if (fn->memo) {
+        MyObject value;
+        const MyObject *args = &operands[operands.size() - nargs];
+        if (fn->memo->lookup(args, &value)) {
+            TRACE(tracer, TRACE_CALL, "return " << value << " (memo)");
+            operands.resize(operands.size() - nargs);
+            push(value);
+            return;
+        }
+        memoArgs.insert(memoArgs.end(), args, args + nargs);
+    }
+    pushd(fn->name, *fn->statements, fn->nslots);
+    env->setMemo(fn->memo);
+    for (int i = nargs - 1; i >= 0; i--) {
+        env->set(i, pop());
+    }
+}
+
+// Runs the callee of `return f(...)` in place of the current frame, whose
+// Return would only hand the value on. The main frame, and memoized calls
+// that still have a result to store, call normally.
+void Interpreter::tailCall(const FunctionDefinition *fn, int nargs) {
+    if (frames.size() == 1 || fn->memo || env->getMemo()) {
+        callFunction(fn, nargs);
+        return;
+    }
+    stats.calls++;
+    TRACE(tracer, TRACE_CALL, "tail call " << fn->name << traceArgs(&operands[operands.size() - nargs], nargs));
+    continuations.pop_back();       // the Return waiting for this call
+    slotTop = env->getOffset();
+    frames.pop_back();
+    if (profiler)
+        profiler->leave();
+    pushd(fn->name, *fn->statements, fn->nslots);
+    for (int i = nargs - 1; i >= 0; i--) {
+        env->set(i, pop());
+    }
+}
+
+// Runs to completion right away: the value is there for the caller's next step
+void Interpreter::callNative(const NativeFunction *fn, int nargs) {
+    stats.calls++;
+    const MyObject *args = operands.data() + operands.size() - nargs;
+    TRACE(tracer, TRACE_CALL, "call " << fn->name << traceArgs(args, nargs));
+    MyObject value = ::callNative(fn, args, nargs);
+    operands.resize(operands.size() - nargs);
+    push(value);
 }
 
 void Interpreter::print(const MyObject &obj) {
-    cout << obj << endl;
+    *out << obj << '\n';
 }
 
-void Interpreter::pushd(const vector<Statement *> &codes, map<string, MyObject> variables) {
-    root.push_back(env);
-    env = new Environment(codes, variables, env->getId() + 1);
+void Interpreter::pushd(const string &name, const vector<Statement *> &codes, int nslots) {
+    if ((int)frames.size() >= maxDepth) {
+        stringstream ss;
+        ss << "Stack overflow: more than " << maxDepth << " nested calls";
+        throw StringException(ss.str());
+    }
+    size_t offset = slotTop;
+    slotTop += nslots;
+    bool grown = false;
+    if (slotTop > slots.size()) {
+        size_t size = max(slotTop, slots.size() * 2);
+        slots.resize(size);
+        defined.resize(size);
+        grown = true;
+    }
+    fill(defined.begin() + offset, defined.begin() + slotTop, 0);
+
+    grown = grown || frames.size() == frames.capacity();
+    frames.push_back(Environment(&codes, offset, nslots, frames.size(), continuations.size(), &stats));
+    stats.frames++;
+    stats.depth(frames.size());
+    if (grown)
+        stats.frameBytes = frames.capacity() * sizeof(Environment) + slots.capacity() * sizeof(MyObject) + defined.capacity();
+    if (grown) {
+        for (vector<Environment>::iterator iter = frames.begin(); iter != frames.end(); iter++) {
+            iter->bind(slots.data(), defined.data());
+        }
+    } else {
+        frames.back().bind(slots.data(), defined.data());
+    }
+    env = &frames.back();
+    if (profiler)
+        profiler->enter(name);
 }
 
 void Interpreter::popd(MyObject retValue) {
-    unsigned long caller = env->getRetSlot();
-    delete env;
-    env = root.back();
-    root.pop_back();
-    assert(caller);
-    env->retn(caller, retValue);
+    if (frames.size() == 1) {
+        // Returning from the main program ends it
+        env->jmp(env->size() - env->getLineno());
+        return;
+    }
+    TRACE(tracer, TRACE_CALL, "return " << retValue);
+    MemoTable *memo = env->getMemo();
+    if (memo) {
+        memo->store(memoArgs.data() + memoArgs.size() - memo->nargs, retValue);
+        memoArgs.resize(memoArgs.size() - memo->nargs);
+    }
+    slotTop = env->getOffset();
+    frames.pop_back();
+    env = &frames.back();
+    push(retValue);
+    if (profiler)
+        profiler->leave();
 }
 
 
@@ -433,34 +694,171 @@ void Interpreter::jmp(int lines) {
 }
 
 
+bool Interpreter::evaluate(const Expression *expr, Statement *stmt, MyObject *ret) {
+    if (!expr->hasCall) {
+        *ret = expr->evaluate(env);
+        return true;
+    }
+    suspend(stmt);
+    suspend(expr, 0);
+    return false;
+}
+
+void Interpreter::schedule(const Expression *expr) {
+    if (expr->hasCall)
+        suspend(expr, 0);
+    else
+        push(expr->evaluate(env));
+}
+
+void Interpreter::suspend(const Expression *expr, int state) {
+    Continuation cont = {expr, NULL, state};
+    continuations.push_back(cont);
+}
+
+void Interpreter::suspend(Statement *stmt) {
+    stats.suspended++;
+    Continuation cont = {NULL, stmt, 0};
+    continuations.push_back(cont);
+}
+
+void Interpreter::push(MyObject value) {
+    operands.push_back(value);
+}
+
+MyObject Interpreter::pop() {
+    MyObject value = operands.back();
+    operands.pop_back();
+    return value;
+}
+
+
 void Interpreter::execute(void) {
     int lineno = env->getLineno();
-    Environment *currentEnv = env;
+    if (lineno >= env->size()) {
+        // Falling off the end of a function returns 0
+        popd(0);
+        return;
+    }
     Statement *stmt = env->getCode(lineno);
-    try {
-        cdbg << stmt->lineno << " " << stmt->toString() << endl;
-        bool success = stmt->execute(*this);
-        if (success) {
-            currentEnv->clearCache();
-            currentEnv->nextLine();
-        }
-    } catch(StringException e) {
-        cout << stmt->lineno << ": " << e.msg << endl;
-        exit(-1);
+    stats.statements++;
+    if (profiler)
+        profiler->statement(stmt->lineno);
+    TRACE(tracer, TRACE_STMT, stmt->lineno << " " << stmt->toString());
+    if (stmt->execute(*this))
+        env->nextLine();
+}
+
+void Interpreter::resume(void) {
+    Continuation cont = continuations.back();
+    continuations.pop_back();
+    if (cont.expr) {
+        cont.expr->step(*this, cont.state);
+    } else if (cont.stmt->resume(*this, pop())) {
+        env->nextLine();
     }
 }
 
-void Interpreter::run(void) {
+bool Interpreter::walk(int nslots) {
     // Init
-    map<string, MyObject> emptyEnv;
-    env = new Environment(codes, emptyEnv, 0);
-    Environment *rootEnv = env;
+    pushd("main", codes, nslots);
     int N = codes.size();
 
     // Running
-    while (!(env == rootEnv && env->getLineno() >= N)) {
-        execute();
+    bool ok = true;
+    try {
+        while (!(frames.size() == 1 && env->getLineno() >= N)) {
+            if (continuations.size() > env->getBase())
+                resume();
+            else
+                execute();
+        }
+    } catch (const StringException &e) {
+        *out << env->getCode(env->getLineno())->lineno << ": " << e.msg << '\n';
+        ok = false;
+    }
+    // What the script printed comes before the reports
+    out->flush();
+    if (profiler)
+        profiler->report(*err);
+
+    if (memoStats) {
+        for (auto iter = functions.begin(); iter != functions.end(); iter++) {
+            if (iter->second->memo)
+                iter->second->memo->report(*err);
+        }
     }
+    return ok;
+}
+
+// False when the script stopped on an error, which it has printed by then
+bool Interpreter::run(void) {
+    chrono::steady_clock::time_point parsed = chrono::steady_clock::now();
+    if (optLevel > 0 && arena) {
+        Arena::Scope scope(arena);
+        size_t before = arena->getBytes();
+        Optimizer optimizer(symbols);
+        optimizer.optimize(codes);
+        stats.astBytes += arena->getBytes() - before;
+    }
+
+    Arena::Scope scope(&heap);
+    Resolver resolver(tailCalls);
+    // Traced calls need the continuation stack, which evaluating in place skips
+    resolver.setNatives(natives, !tracer.enabled(TRACE_CALL));
+    int nslots = resolver.resolve(vector<string>(), codes);
+    resolver.findPure();
+
+    // Only the statement walker has the hooks the profiler needs
+    if (profiler)
+        engine = ENGINE_TREE;
+
+    bool ok;
+    if (engine == ENGINE_CLOSURE) {
+        stats.engine = "closure";
+        ClosureEngine closures(maxDepth, memoSize, &tracer, &stats, out);
+        ClosureCompiler compiler(&closures);
+        ok = closures.run(compiler.compile("main", 0, nslots, codes, false));
+        out->flush();
+        if (memoStats)
+            closures.report(*err);
+    } else if (engine == ENGINE_VM) {
+        Module module;
+        Compiler compiler(&module);
+        compiler.compile("main", 0, nslots, codes);
+        TRACE(tracer, TRACE_CODE, module.toString());
+        stats.engine = "vm";
+        VM vm(&module, maxDepth, memoSize, jit, jitDump, &tracer, &stats, out);
+        ok = vm.run();
+        out->flush();
+        if (memoStats) {
+            for (vector<FunctionCode *>::iterator iter = module.functions.begin(); iter != module.functions.end(); iter++) {
+                if ((*iter)->memo)
+                    (*iter)->memo->report(*err);
+            }
+        }
+    } else {
+        stats.engine = "tree";
+        ok = walk(nslots);
+    }
+
+    // One JSON object per run, read by bench/run.sh
+    if (bench) {
+        chrono::steady_clock::time_point finished = chrono::steady_clock::now();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        // Formatted apart, so that err keeps its own number format
+        ostringstream line;
+        line << fixed << setprecision(6)
+             << "{\"statements\": " << resolver.getStatements()
+             << ", \"calls\": " << stats.calls
+             << ", \"parse_seconds\": " << chrono::duration<double>(parsed - started).count()
+             << ", \"run_seconds\": " << chrono::duration<double>(finished - parsed).count()
+             << ", \"peak_rss_kb\": " << usage.ru_maxrss << "}";
+        *err << line.str() << endl;
+    }
+    stats.report(*err, statsFormat);
+    return ok;
 }
 
 
@@ -468,17 +866,28 @@ void Statement::setLineno(int lineno) {
     this->lineno = lineno;
 }
 
+bool Statement::resume(Interpreter &interpreter, MyObject value) {
+    return true;
+}
 
-Assignment::Assignment(const string &name, const Expression *expr) : name(name), expr(expr) {}
+
+Assignment::Assignment(const string &name, const Expression *expr) : name(name), expr(expr), slot(-1) {}
+
+const string &Assignment::getName() const {
+    return name;
+}
 
 
 bool Assignment::execute(Interpreter &interpreter) {
     MyObject val;
-    bool success = expr->evaluate(interpreter.getEnv(), &val);
-    if (success) {
-        interpreter.setVariable(name, val);
-    }
-    return success;
+    if (!interpreter.evaluate(expr, this, &val))
+        return false;
+    return resume(interpreter, val);
+}
+
+bool Assignment::resume(Interpreter &interpreter, MyObject val) {
+    interpreter.setVariable(slot, val);
+    return true;
 }
 
 string Assignment::toString() const {
@@ -487,11 +896,23 @@ string Assignment::toString() const {
 
 
 Function::Function(const string &name, const vector<string> &arguments, const vector<Statement *> &stmts)
-    : name(name), statements(stmts.begin(), stmts.end()), arguments(arguments.begin(), arguments.end()) {
+    : name(name), arguments(arguments.begin(), arguments.end()), statements(stmts.begin(), stmts.end()), nslots(0), pure(false) {
+}
+
+const string &Function::getName() const {
+    return name;
+}
+
+const vector<Statement *> &Function::getStatements() const {
+    return statements;
+}
+
+void Function::setPure(bool pure) {
+    this->pure = pure;
 }
 
 bool Function::execute(Interpreter &interpreter) {
-    interpreter.registerFunction(name, arguments, statements);
+    interpreter.registerFunction(name, arguments, statements, nslots, pure);
     return true;
 }
 
@@ -505,10 +926,14 @@ Print::Print(const Expression *expr) : expr(expr) {}
 
 bool Print::execute(Interpreter &interpreter) {
     MyObject obj;
-    bool success = expr->evaluate(interpreter.getEnv(), &obj);
-    if (success)
-        interpreter.print(obj);
-    return success;
+    if (!interpreter.evaluate(expr, this, &obj))
+        return false;
+    return resume(interpreter, obj);
+}
+
+bool Print::resume(Interpreter &interpreter, MyObject obj) {
+    interpreter.print(obj);
+    return true;
 }
 
 string Print::toString() const {
@@ -516,15 +941,33 @@ string Print::toString() const {
 }
 
 
-If::If(Expression *condition, int skiprows) : condition(condition), skiprows(skiprows) {}
+Branch::Branch(int skiprows) : skiprows(skiprows) {}
+
+int Branch::getSkiprows() const {
+    return skiprows;
+}
+
+void Branch::setSkiprows(int skiprows) {
+    this->skiprows = skiprows;
+}
+
+
+If::If(const Expression *condition, int skiprows) : Branch(skiprows), condition(condition) {}
+
+const Expression *If::getCondition() const {
+    return condition;
+}
 
 
 bool If::execute(Interpreter &interpreter) {
     MyObject obj;
-    bool success = condition->evaluate(interpreter.getEnv(), &obj);
-    if (!success)
-        return success;
-    if (!obj)
+    if (!interpreter.evaluate(condition, this, &obj))
+        return false;
+    return resume(interpreter, obj);
+}
+
+bool If::resume(Interpreter &interpreter, MyObject obj) {
+    if (!obj.truthy())
         interpreter.jmp(skiprows);   // The interpreter adds by one itself
     return true;
 }
@@ -536,11 +979,53 @@ string If::toString() const {
 }
 
 
+Jump::Jump(int skiprows) : Branch(skiprows) {}
+
+
+bool Jump::execute(Interpreter &interpreter) {
+    interpreter.jmp(skiprows);
+    return true;
+}
+
+string Jump::toString() const {
+    stringstream ss;
+    ss << "skip " << skiprows << " lines" << endl;
+    return ss.str();
+}
+
+
+Loop::Loop(const Expression *condition, int skiprows) : Branch(skiprows), condition(condition) {}
+
+
+bool Loop::execute(Interpreter &interpreter) {
+    MyObject obj;
+    if (!interpreter.evaluate(condition, this, &obj))
+        return false;
+    return resume(interpreter, obj);
+}
+
+bool Loop::resume(Interpreter &interpreter, MyObject obj) {
+    if (obj.truthy())
+        interpreter.jmp(skiprows);
+    return true;
+}
+
+string Loop::toString() const {
+    stringstream ss;
+    ss << "while (" << condition->toString() << ") skip " << skiprows << " lines" << endl;
+    return ss.str();
+}
+
+
 bool Return::execute(Interpreter &interpreter) {
     MyObject retValue;
-    bool success = expr->evaluate(interpreter.getEnv(), &retValue);
-    if (success)
-        interpreter.popd(retValue);
+    if (!interpreter.evaluate(expr, this, &retValue))
+        return false;
+    return resume(interpreter, retValue);
+}
+
+bool Return::resume(Interpreter &interpreter, MyObject retValue) {
+    interpreter.popd(retValue);
     return false;
 }
 
@@ -552,12 +1037,4 @@ Return::Return(Expression *expr) : expr(expr) {
 
 string Return::toString() const {
     return "Return(" + expr->toString() + ")";
-}
-
-
-Interpreter interpreter;
-
-
-Interpreter &getInterpreter() {
-    return interpreter;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef H_INTERPRETER
 #define H_INTERPRETER
 
+#include <chrono>
 #include <iostream>
 #include <map>
 #include <string>
@@ -8,20 +9,88 @@
 #include <stack>
 #include <vector>
 #include <stdlib.h>
+#include "arena.hpp"
+#include "object.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 using namespace std;
 
 
-typedef int MyObject;
-
 class Environment;
 
 class Call;
 
+class Compiler;
+
+class Resolver;
+
+class Optimizer;
+
+class MemoTable;
+
+class ClosureCompiler;
+
+class CacheWriter;
+
+class Profiler;
+
+struct Program;
+
+class Symbols;
+
+struct ClosureOperand;
+
+struct NativeFunction;
+
+class Natives;
+
+class Interpreter;
+
+
+enum Engine {
+    ENGINE_TREE,        // walk the statements directly
+    ENGINE_VM,          // compile to bytecode and run it on the register VM
+    ENGINE_CLOSURE,     // compile every node into a closure specialized for its operands
+};
+
+// Nested calls allowed before a script fails with a stack overflow
+#define DEFAULT_MAX_DEPTH 1000000
+
+// Optimization level used unless -O0/-O1 is given
+#define DEFAULT_OPT_LEVEL 1
+
+// Results kept per pure function by --memo without a size
+#define DEFAULT_MEMO_SIZE 4096
+
+// Arguments of a native called in place that fit on the stack; more go to the heap
+#define CALL_SMALL_ARGS 8
+
 
 class Expression {
 public:
-    virtual bool evaluate(Environment const *env, MyObject *) const = 0;
+    mutable bool hasCall;   // evaluating it may have to wait for a function call; the resolver
+                            // clears it for natives the statement walker can call in place
+
+    Expression(bool hasCall);
+    virtual MyObject evaluate(Environment const *env) const = 0;
+    virtual void step(Interpreter &interpreter, int state) const;
+    virtual int compile(Compiler &compiler, int target) const = 0;
+    virtual ClosureOperand closure(ClosureCompiler &compiler) const = 0;
+    virtual int cache(CacheWriter &writer) const = 0;
+    virtual void resolve(Resolver &resolver) const = 0;
+    virtual const Expression *optimize(Optimizer &optimizer) const;
+    // Gives the same value on every iteration of the loop being optimized
+    virtual bool isInvariant(const Optimizer &optimizer) const;
+    // This expression with its invariant parts read from variables set before the
+    // loop. truthy: it has been true, so all of its && operands were evaluated too.
+    virtual const Expression *hoist(Optimizer &optimizer, bool truthy) const;
     virtual string toString() const = 0;
+
+    // Nodes belong to the arena of their program and go with it
+    static void *operator new(size_t size) {
+        return Arena::allocateNode(size, NULL);
+    }
+    static void operator delete(void *) {}
 };
 
 class Statement;
@@ -46,51 +115,73 @@ public:
 };
 
 
+// A call frame on the interpreter's frame stack. The variables are a region of
+// the shared slot stack and the code is the function's own, never a copy.
 class Environment {
 private:
-    map<string, MyObject> variables;
-    const vector<Statement *> codes;
+    MyObject *variables;
+    char *defined;
+    size_t offset;                          // where the variables start in the slot stack
+    int nslots;
+    const vector<Statement *> *codes;
     int lineno;
-    const int id;
-    map<unsigned long, MyObject> callCache;
-    unsigned long retSlot;
+    int id;
+    size_t base;
+    MemoTable *memo;                        // where to store the result on return, if memoized
+    Stats *stats;
 public:
-    Environment(const vector<Statement *> &codes, map<string, MyObject> variables, const int id);
-    Nullable<MyObject> get(string name) const;
+    Environment(const vector<Statement *> *codes, size_t offset, int nslots, const int id, size_t base, Stats *stats);
+    void bind(MyObject *slots, char *defined);
+    size_t getOffset() const;
+    Nullable<MyObject> get(int slot) const;
 
-    void set(string name, int value);
+    void set(int slot, MyObject value);
     int getLineno() const;
     int getId() const;
+    size_t getBase() const;
+    MemoTable *getMemo() const;
+    void setMemo(MemoTable *memo);
+    Stats *getStats() const;
+    int size() const;
     void jmp(int);
     void nextLine();
     void print() const;
     Statement *getCode(int i) const;
-    void setRetVar(string name);
-
-    bool hasCache(unsigned long) const;
-    MyObject getCache(unsigned long) const;
-    void setCache(unsigned long, MyObject);
-    void clearCache();
-
-    void setRetSlot(unsigned long);
-    unsigned long getRetSlot() const;
-
-    void retn(unsigned long, const MyObject);
 };
 
 
 class BinaryOp : public Expression {
 protected:
     const Expression &left, &right;
+
+    // This node if the operands are unchanged, otherwise a copy over the new ones
+    template <class T>
+    const Expression *rebuild(const Expression &l, const Expression &r) const {
+        return &l == &left && &r == &right ? this : new T(l, r);
+    }
 public:
     BinaryOp (const Expression &left, const Expression &right);
+    virtual MyObject apply(MyObject left, MyObject right) const = 0;
+    virtual bool canFold(MyObject left, MyObject right) const;
+    virtual const Expression *simplify(const Expression &left, const Expression &right) const = 0;
+    void step(Interpreter &, int) const override;
+    void resolve(Resolver &) const override;
+    const Expression *optimize(Optimizer &) const override;
+    bool isInvariant(const Optimizer &) const override;
+    const Expression *hoist(Optimizer &, bool) const override;
 };
 
 
 class Plus : public BinaryOp {
 public:
     Plus(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    bool canFold(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -98,7 +189,12 @@ public:
 class Minus : public BinaryOp {
 public:
     Minus(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -106,7 +202,12 @@ public:
 class Times : public BinaryOp {
 public:
     Times(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -114,7 +215,13 @@ public:
 class Divide : public BinaryOp {
 public:
     Divide(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    bool canFold(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -122,7 +229,12 @@ public:
 class GreaterThan : public BinaryOp {
 public:
     GreaterThan(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -130,7 +242,12 @@ public:
 class LessThan : public BinaryOp {
 public:
     LessThan(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -138,7 +255,12 @@ public:
 class GreaterEqual : public BinaryOp {
 public:
     GreaterEqual(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -146,7 +268,12 @@ public:
 class LessEqual : public BinaryOp {
 public:
     LessEqual(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -154,7 +281,13 @@ public:
 class Equal : public BinaryOp {
 public:
     Equal(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    bool canFold(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
     string toString() const override;
 };
 
@@ -162,7 +295,14 @@ public:
 class LogicalAnd : public BinaryOp {
 public:
     LogicalAnd(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    void step(Interpreter &, int) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    const Expression *hoist(Optimizer &, bool) const override;
     string toString() const override;
 };
 
@@ -170,78 +310,215 @@ public:
 class LogicalOr : public BinaryOp {
 public:
     LogicalOr(const Expression &left, const Expression &right);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    MyObject apply(MyObject, MyObject) const override;
+    const Expression *simplify(const Expression &, const Expression &) const override;
+    void step(Interpreter &, int) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    const Expression *hoist(Optimizer &, bool) const override;
     string toString() const override;
 };
 
 
 class Literal : public Expression {
 private:
-    const MyObject &value;
+    const MyObject value;
 public:
     Literal(const MyObject &value);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject getValue() const;
+    MyObject evaluate(Environment const *) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) const override;
+    bool isInvariant(const Optimizer &) const override;
     string toString() const override;
 };
 
 
 class Variable : public Expression {
 private:
-    const string name;
+    const string &name;                // interned in the symbols of its Program, which outlives it
+    mutable int slot;       // filled in by the resolver
 public:
     Variable(const string &name);
-    bool evaluate(Environment const *, MyObject *) const override;
+    MyObject evaluate(Environment const *) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) const override;
+    bool isInvariant(const Optimizer &) const override;
     string toString() const override;
 };
 
 
+// Evaluation waiting on the continuation stack: either an expression to
+// step from the given state, or a statement waiting for its value.
+struct Continuation {
+    const Expression *expr;
+    Statement *stmt;
+    int state;
+};
+
+
+// A registered function. Never modified once registered, so call sites may keep pointers to it.
+// Parameters occupy slots [0, arity) of the frame.
+struct FunctionDefinition {
+    const string name;
+    const int arity;
+    const int nslots;
+    const vector<Statement *> *statements;
+    MemoTable *const memo;                  // NULL unless the function is pure and memoization is on
+
+    FunctionDefinition(const string &name, int arity, int nslots, const vector<Statement *> *statements, MemoTable *memo);
+    ~FunctionDefinition();
+};
+
+
 class Interpreter {
 private:
-    
-    vector<Environment *> root;
-    map<string, pair<vector<string>, vector<Statement *> > > functions;
+    Arena heap;                             // strings made while running, first so that it goes last
+    vector<Environment> frames;             // contiguous call stack, env is the last one
+    vector<MyObject> slots;                 // variables of every frame, bump allocated
+    vector<char> defined;
+    size_t slotTop;
+    int maxDepth;
+    map<string, const FunctionDefinition *> functions;
+    unsigned version;                       // bumped whenever a function is registered
     Environment *env;
     vector<Statement *> codes;
+    Arena *arena;                           // of the last program loaded, which the optimizer adds to
+    Symbols *symbols;                       // and the names it makes up go to
+    Engine engine;
+    int optLevel;
+    bool tailCalls;
+    size_t memoSize;                        // 0 disables memoization
+    bool memoStats;
+    bool jit;                               // compile hot functions to machine code on the VM
+    bool jitDump;
+    bool bench;                             // report timings and counts on exit
+    chrono::steady_clock::time_point started;   // parsing starts right after the interpreter is created
+    Stats stats;
+    StatsFormat statsFormat;                // how to report them on exit, STATS_NONE not at all
+    Profiler *profiler;                     // NULL unless --profile, the statement walker feeds it
+    Natives *natives;                       // what calls bind to when no script function has the name
+    Tracer tracer;
+    ostream *out;                           // what the script prints, and its error
+    ostream *err;                           // reports asked for by options
+    vector<MyObject> memoArgs;              // arguments of the memoized calls in progress
+    vector<Continuation> continuations;
+    vector<MyObject> operands;
 
 public:
     Interpreter();
 
+    ~Interpreter();
+
+    void setEngine(Engine engine);
+
+    void setOptLevel(int level);
+
+    void setTailCalls(bool enabled);
+
+    void setMemoSize(size_t size);
+
+    void setMemoStats(bool enabled);
+
+    void setJit(bool enabled);
+
+    void setJitDump(bool enabled);
+
+    void setBench(bool enabled);
+
+    void setStats(StatsFormat format);
+
+    void setProfile(const string &path);
+
+    Tracer &getTracer();
+
+    Natives &getNatives();
+
+    void setOutput(ostream *out, ostream *err);
+
+    void setMaxDepth(int maxDepth);
+
     Environment *getEnv();
 
-    void pushCode(Statement *stmt);
+    void load(Program *program);
+
+    void setVariable(int slot, MyObject value);
+
+    bool registerFunction(const string&, const vector<string> &, const vector<Statement *> &, int nslots, bool pure);
 
-    void setVariable(string name, MyObject value);
+    const FunctionDefinition *findFunction(const string &);
 
-    MyObject getVariable(string name);
+    unsigned getVersion() const;
 
-    bool registerFunction(const string&, const vector<string> &, const vector<Statement *> &);
+    void callFunction(const FunctionDefinition *fn, int nargs);
 
-    bool hasFunction(const string &);
+    void tailCall(const FunctionDefinition *fn, int nargs);
 
-    bool callFunction(const string &, const vector<Expression *>, unsigned long);
+    void callNative(const NativeFunction *fn, int nargs);
 
     void print(const MyObject &obj);
 
-    void pushd(const vector<Statement *> &codes, map<string, MyObject> variables);
+    void pushd(const string &name, const vector<Statement *> &codes, int nslots);
 
     void popd(MyObject retVal);
 
     void jmp(int);
 
+    bool evaluate(const Expression *expr, Statement *stmt, MyObject *ret);
+
+    void schedule(const Expression *expr);
+
+    void suspend(const Expression *expr, int state);
+
+    void suspend(Statement *stmt);
+
+    void push(MyObject value);
+
+    MyObject pop();
+
     void execute(void);
 
-    void run(void);
+    void resume(void);
+
+    bool walk(int nslots);
+
+    bool run(void);
 };
 
 
 class Call : public Expression {
 private:
-    const string name;
+    const string &name;
     const vector<Expression *> args;
+    mutable const FunctionDefinition *callee;   // inline cache, valid while version matches the interpreter's
+    mutable unsigned version;
+    mutable bool tail;                          // its value is returned right away, set by the resolver
+    mutable const NativeFunction *native;       // set by the resolver when no script function has the name
+
+    const FunctionDefinition *lookup(Interpreter &) const;
 
 public:
-    Call(string name, const vector<Expression *> &args);
-    bool evaluate(Environment const *, MyObject *) const override;
+    Call(const string &name, const vector<Expression *> &args);
+    static void *operator new(size_t size) {
+        return Arena::allocateNode(size, Arena::destroy<Call>);
+    }
+    const string &getName() const;
+    bool isTail() const;
+    void setTail(bool tail) const;
+    const NativeFunction *getNative() const;
+    MyObject evaluate(Environment const *) const override;
+    void step(Interpreter &, int) const override;
+    int compile(Compiler &, int) const override;
+    ClosureOperand closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) const override;
+    const Expression *optimize(Optimizer &) const override;
     string toString() const override;
 };
 
@@ -250,41 +527,121 @@ class Statement {
 public:
     int lineno;
     virtual bool execute(Interpreter &interpreter) = 0;
+    virtual bool resume(Interpreter &interpreter, MyObject value);
+    virtual void compile(Compiler &compiler) const = 0;
+    virtual void closure(ClosureCompiler &compiler) const = 0;
+    virtual int cache(CacheWriter &writer) const = 0;
+    virtual void resolve(Resolver &resolver) = 0;
+    virtual Statement *optimize(Optimizer &optimizer);
     virtual string toString() const = 0;
     void setLineno(int lineno);
+
+    // Nodes belong to the arena of their program and go with it
+    static void *operator new(size_t size) {
+        return Arena::allocateNode(size, NULL);
+    }
+    static void operator delete(void *) {}
 };
 
 
-class If : public Statement {
-private:
-    Expression *condition;
+// Base of the statements that move control by a number of rows
+class Branch : public Statement {
+protected:
     int skiprows;
 public:
-    If(Expression *, int);
+    Branch(int skiprows);
+    int getSkiprows() const;
+    void setSkiprows(int skiprows);
+};
+
+
+class If : public Branch {
+private:
+    const Expression *condition;
+public:
+    If(const Expression *, int);
+    const Expression *getCondition() const;
+    bool execute(Interpreter &interpreter) override;
+    bool resume(Interpreter &interpreter, MyObject value) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    Statement *optimize(Optimizer &) override;
+    string toString() const override;
+};
+
+
+// Unconditional jump, left behind by the optimizer for constant false conditions
+class Jump : public Branch {
+public:
+    Jump(int);
     bool execute(Interpreter &interpreter) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    string toString() const override;
+};
+
+
+// Bottom of a while loop rotated by the optimizer: the condition is tested here
+// again and jumps back into the body while it holds, instead of a Jump to the If on top
+class Loop : public Branch {
+private:
+    const Expression *condition;
+public:
+    Loop(const Expression *, int);
+    bool execute(Interpreter &interpreter) override;
+    bool resume(Interpreter &interpreter, MyObject value) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
     string toString() const override;
 };
 
 
 class Assignment : public Statement {
 private:
-    const string name;
+    const string &name;
     const Expression *expr;
+    int slot;
 public:
     Assignment(const string &name, const Expression *expr);
+    const string &getName() const;
     bool execute(Interpreter &interpreter) override;
+    bool resume(Interpreter &interpreter, MyObject value) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    Statement *optimize(Optimizer &) override;
     string toString() const override;
 };
 
 
 class Function : public Statement {
 private:
-    const string name;
+    const string &name;
     const vector<string> arguments;
-    const vector<Statement *> statements;
+    vector<Statement *> statements;
+    int nslots;
+    bool pure;                  // result depends on the arguments only, found by the resolver
 public:
     Function(const string &name, const vector<string> &arguments, const vector<Statement *> &stmts);
+    static void *operator new(size_t size) {
+        return Arena::allocateNode(size, Arena::destroy<Function>);
+    }
+    const string &getName() const;
+    const vector<Statement *> &getStatements() const;
+    void setPure(bool pure);
     bool execute(Interpreter &interpreter) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    Statement *optimize(Optimizer &) override;
     string toString() const override;
 };
 
@@ -295,6 +652,12 @@ private:
 public:
     Print(const Expression *expr);
     bool execute(Interpreter &interpreter) override;
+    bool resume(Interpreter &interpreter, MyObject value) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    Statement *optimize(Optimizer &) override;
     string toString() const override;
 };
 
@@ -304,10 +667,13 @@ private:
 public:
     Return(Expression *expr);
     bool execute(Interpreter &interpreter) override;
+    bool resume(Interpreter &interpreter, MyObject value) override;
+    void compile(Compiler &) const override;
+    void closure(ClosureCompiler &) const override;
+    int cache(CacheWriter &) const override;
+    void resolve(Resolver &) override;
+    Statement *optimize(Optimizer &) override;
     string toString() const override;
 };
 
-Interpreter &getInterpreter();
-
-
 #endif /* H_INTERPRETER */
\ No newline at end of file
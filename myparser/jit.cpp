@@ -0,0 +1,475 @@
+#include "jit.hpp"
+#include "stats.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#ifdef JIT_SUPPORTED
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+// x86-64 register numbers
+#define RAX 0
+#define RCX 1
+#define RBX 3
+#define RSP 4
+#define RDI 7
+#define R12 12
+
+// Condition codes, negated by flipping the lowest bit
+#define CC_B 0x2
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_S 0x8
+#define CC_L 0xC
+#define CC_GE 0xD
+#define CC_LE 0xE
+#define CC_G 0xF
+
+#define SLOT(reg) ((int)((reg) * sizeof(MyObject)))
+#define STATE(field) ((int)offsetof(JitState, field))
+
+
+JIT::JIT(Module *module, const vector<int> *bindings, bool dump, Stats *stats)
+    : module(module), bindings(bindings), dump(dump), stackBytes(JIT_STACK_DEFAULT - JIT_STACK_RESERVE), stats(stats) {
+#ifdef JIT_SUPPORTED
+    // Scripts may run on worker threads, whose stacks are smaller than the main one's
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *low;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &low, &size) == 0) {
+            size_t left = (const char *)__builtin_frame_address(0) - (const char *)low;
+            stackBytes = left > JIT_STACK_RESERVE ? left - JIT_STACK_RESERVE : 0;
+        }
+        pthread_attr_destroy(&attr);
+    }
+#endif
+}
+
+JIT::~JIT() {
+#ifdef JIT_SUPPORTED
+    for (vector<pair<void *, size_t> >::iterator iter = blocks.begin(); iter != blocks.end(); iter++) {
+        munmap(iter->first, iter->second);
+    }
+#endif
+}
+
+
+bool JIT::available() {
+#ifdef JIT_SUPPORTED
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+void JIT::emit(int byte) {
+    bytes.push_back((unsigned char)byte);
+}
+
+void JIT::emit32(int value) {
+    for (int i = 0; i < 4; i++) {
+        emit((unsigned)value >> (8 * i));
+    }
+}
+
+void JIT::emit64(unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        emit(value >> (8 * i));
+    }
+}
+
+// [base + disp32] operand, with the SIB byte rsp and r12 need as a base
+void JIT::modrm(int reg, int base, int disp) {
+    emit(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        emit(0x24);
+    emit32(disp);
+}
+
+// One or two byte opcode (0x0F xx) with a memory operand; reg is a register or an opcode extension
+void JIT::memory(int opcode, int reg, int base, int disp, bool wide) {
+    int rex = 0x40 | (wide ? 8 : 0) | (reg & 8) >> 1 | (base & 8) >> 3;
+    if (rex != 0x40)
+        emit(rex);
+    if (opcode > 0xFF)
+        emit(opcode >> 8);
+    emit(opcode & 0xFF);
+    modrm(reg, base, disp);
+}
+
+// eax = R[reg]
+void JIT::load(int reg) {
+    memory(0x8B, RAX, RBX, SLOT(reg));
+}
+
+// R[reg] = rax, whose upper half every 32-bit operation leaves zero: the int tag
+void JIT::store(int reg) {
+    memory(0x89, RAX, RBX, SLOT(reg), true);
+}
+
+// Jump or call with a 32-bit displacement, returning where to patch it
+size_t JIT::jump(int opcode) {
+    if (opcode > 0xFF)
+        emit(opcode >> 8);
+    emit(opcode & 0xFF);
+    emit32(0);
+    return bytes.size() - 4;
+}
+
+void JIT::patch(size_t at, size_t target) {
+    int disp = (int)target - (int)(at + 4);
+    memcpy(&bytes[at], &disp, 4);
+}
+
+
+// Function called by a CALL or TCALL, -1 when calling it would raise an error
+int JIT::callee(const Instruction &inst) const {
+    int index = inst.op == OP_CALL || inst.op == OP_TCALL ? (*bindings)[inst.b] : inst.b;
+    if (index < 0 || module->functions[index]->nparams != inst.c)
+        return -1;
+    return index;
+}
+
+
+// Adds the function and everything it calls to the batch, unless one of them cannot be compiled
+bool JIT::collect(FunctionCode *function, vector<FunctionCode *> &batch) const {
+    if (function->native || find(batch.begin(), batch.end(), function) != batch.end())
+        return true;
+    if (!function->pure || function->memo)
+        return false;
+    batch.push_back(function);
+    for (vector<Instruction>::const_iterator inst = function->code.begin(); inst != function->code.end(); inst++) {
+        switch (inst->op) {
+        case OP_PRINT:
+        case OP_DEFUN:
+        case OP_LOADK:
+        case OP_NATIVE:
+            return false;
+        case OP_CALL:
+        case OP_CALLF:
+        case OP_TCALL:
+        case OP_TCALLF: {
+            int index = callee(*inst);
+            if (index < 0 || !collect(module->functions[index], batch))
+                return false;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+
+static int condition(unsigned op) {
+    switch (op) {
+    case OP_GT: case OP_GTI: case OP_JGT: case OP_JGTI: return CC_G;
+    case OP_LT: case OP_LTI: case OP_JLT: case OP_JLTI: return CC_L;
+    case OP_GE: case OP_GEI: case OP_JGE: case OP_JGEI: return CC_GE;
+    case OP_LE: case OP_LEI: case OP_JLE: case OP_JLEI: return CC_LE;
+    default: return CC_E;
+    }
+}
+
+
+// Native code of one function, called as MyObject f(const MyObject *args, JitState *state).
+// rbx points to the registers in the native frame, r12 to the state.
+void JIT::assemble(FunctionCode *function, vector<size_t> &offsets) {
+    int n = function->code.size();
+    int frame = (function->nregs * sizeof(MyObject) + 15) / 16 * 16 + 8;     // keeps rsp 16-byte aligned at calls
+    vector<bool> targets(n + 1, false);
+    for (int i = 0; i < n; i++) {
+        if (function->code[i].kind(1) == OPERAND_JUMP)
+            targets[function->code[i].b] = true;
+    }
+    vector<pair<size_t, int> > branches;    // displacements to patch with the start of an instruction
+    vector<size_t> fails, returns;
+
+    size_t entry = bytes.size();
+    emit(0x53);                                         // push rbx
+    emit(0x41); emit(0x54);                             // push r12
+    emit(0x48); emit(0x81); emit(0xEC); emit32(frame);  // sub rsp, frame
+    emit(0x48); emit(0x89); emit(0xE3);                 // mov rbx, rsp
+    emit(0x49); emit(0x89); emit(0xF4);                 // mov r12, rsi
+    memory(0x83, 5, R12, STATE(budget)); emit(1);       // sub dword [r12 + budget], 1
+    fails.push_back(jump(0x0F80 | CC_S));
+    memory(0x3B, RSP, R12, STATE(stackLimit), true);    // cmp rsp, [r12 + stackLimit]
+    fails.push_back(jump(0x0F80 | CC_B));
+    // Only ints are handled: any other argument leaves the call to the VM
+    for (int i = 0; i < function->nparams; i++) {
+        memory(0x83, 7, RDI, SLOT(i) + 4); emit(0);    // cmp dword [rdi + i + 4], 0
+        fails.push_back(jump(0x0F80 | CC_NE));
+        memory(0x8B, RAX, RDI, SLOT(i));
+        store(i);
+    }
+    emit(0x31); emit(0xC0);                             // xor eax, eax
+    for (int i = function->nparams; i < function->nregs; i++) {
+        store(i);
+    }
+    size_t body = bytes.size();
+
+    offsets.assign(n + 1, 0);
+    for (int i = 0; i < n; i++) {
+        offsets[i] = bytes.size();
+        const Instruction &inst = function->code[i];
+        switch (inst.op) {
+        case OP_NOP:
+            break;
+        case OP_MOVE:
+            load(inst.b);
+            store(inst.a);
+            break;
+        case OP_LOADI:
+            memory(0xC7, 0, RBX, SLOT(inst.a));
+            emit32(inst.b);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+            load(inst.b);
+            memory(inst.op == OP_ADD ? 0x03 : inst.op == OP_SUB ? 0x2B : 0x0FAF, RAX, RBX, SLOT(inst.c));
+            store(inst.a);
+            break;
+        case OP_DIV: {
+            // idiv faults on a zero divisor and on INT_MIN / -1: the VM takes both
+            load(inst.b);
+            memory(0x8B, RCX, RBX, SLOT(inst.c));       // mov ecx, [rbx + c]
+            emit(0x85); emit(0xC9);                     // test ecx, ecx
+            fails.push_back(jump(0x0F80 | CC_E));
+            emit(0x83); emit(0xF9); emit(0xFF);         // cmp ecx, -1
+            size_t divide = jump(0x0F80 | CC_NE);
+            emit(0x3D); emit32(INT_MIN);                // cmp eax, INT_MIN
+            fails.push_back(jump(0x0F80 | CC_E));
+            patch(divide, bytes.size());
+            emit(0x99);                                 // cdq
+            emit(0xF7); emit(0xF9);                     // idiv ecx
+            store(inst.a);
+            break;
+        }
+        case OP_ADDI:
+        case OP_SUBI:
+            load(inst.b);
+            emit(inst.op == OP_ADDI ? 0x05 : 0x2D);     // add/sub eax, imm32
+            emit32(inst.c);
+            store(inst.a);
+            break;
+        case OP_MULI:
+            load(inst.b);
+            emit(0x69); emit(0xC0); emit32(inst.c);     // imul eax, eax, imm32
+            store(inst.a);
+            break;
+        case OP_DIVI:
+            load(inst.b);
+            if (inst.c == 0) {
+                fails.push_back(jump(0xE9));
+                break;
+            }
+            if (inst.c == -1) {
+                emit(0x3D); emit32(INT_MIN);            // cmp eax, INT_MIN
+                fails.push_back(jump(0x0F80 | CC_E));
+            }
+            emit(0xB9); emit32(inst.c);                 // mov ecx, imm32
+            emit(0x99);                                 // cdq
+            emit(0xF7); emit(0xF9);                     // idiv ecx
+            store(inst.a);
+            break;
+        case OP_GT: case OP_LT: case OP_GE: case OP_LE: case OP_EQ:
+        case OP_GTI: case OP_LTI: case OP_GEI: case OP_LEI: case OP_EQI: {
+            int cc = condition(inst.op);
+            load(inst.b);
+            if (inst.kind(2) == OPERAND_IMMEDIATE) {
+                emit(0x3D); emit32(inst.c);             // cmp eax, imm32
+            } else {
+                memory(0x3B, RAX, RBX, SLOT(inst.c));   // cmp eax, [rbx + c]
+            }
+            emit(0x0F); emit(0x90 | cc); emit(0xC0);    // setcc al
+            emit(0x0F); emit(0xB6); emit(0xC0);         // movzx eax, al
+            store(inst.a);
+            // A conditional jump on the result branches on the flags still set
+            const Instruction &next = function->code[i + 1];
+            if ((next.op == OP_JMPF || next.op == OP_JMPT) && next.a == inst.a && !targets[i + 1]) {
+                offsets[++i] = bytes.size();
+                branches.push_back(make_pair(jump(0x0F80 | (next.op == OP_JMPF ? cc ^ 1 : cc)), next.b));
+            }
+            break;
+        }
+        case OP_JMP:
+            branches.push_back(make_pair(jump(0xE9), inst.b));
+            break;
+        case OP_JMPF:
+        case OP_JMPT:
+            memory(0x83, 7, RBX, SLOT(inst.a)); emit(0);    // cmp dword [rbx + a], 0
+            branches.push_back(make_pair(jump(0x0F80 | (inst.op == OP_JMPF ? CC_E : CC_NE)), inst.b));
+            break;
+        case OP_JGT: case OP_JLT: case OP_JGE: case OP_JLE: case OP_JEQ:
+        case OP_JGTI: case OP_JLTI: case OP_JGEI: case OP_JLEI: case OP_JEQI:
+            load(inst.a);
+            if (inst.kind(2) == OPERAND_IMMEDIATE) {
+                emit(0x3D); emit32(inst.c);             // cmp eax, imm32
+            } else {
+                memory(0x3B, RAX, RBX, SLOT(inst.c));   // cmp eax, [rbx + c]
+            }
+            branches.push_back(make_pair(jump(0x0F80 | condition(inst.op)), inst.b));
+            break;
+        case OP_CHKDEF:
+            memory(0x83, 7, RBX, SLOT(inst.a)); emit(0);
+            fails.push_back(jump(0x0F80 | CC_E));
+            break;
+        case OP_TCALL:
+        case OP_TCALLF:
+            // Calling itself reuses the frame; any other callee gets its own, the RET that follows returns its value
+            if (module->functions[callee(inst)] == function) {
+                memory(0x83, 0, R12, STATE(calls), true); emit(1);  // add qword [r12 + calls], 1
+                for (int j = 0; j < inst.c; j++) {
+                    load(inst.a + j);
+                    store(j);
+                }
+                emit(0x31); emit(0xC0);
+                for (int j = inst.c; j < function->nregs; j++) {
+                    store(j);
+                }
+                patch(jump(0xE9), body);
+                break;
+            }
+            // fall through
+        case OP_CALL:
+        case OP_CALLF: {
+            FunctionCode *target = module->functions[callee(inst)];
+            memory(0x83, 0, R12, STATE(calls), true); emit(1);
+            memory(0x8D, RDI, RBX, SLOT(inst.a), true);         // lea rdi, [rbx + a]
+            emit(0x4C); emit(0x89); emit(0xE6);                 // mov rsi, r12
+            if (target == function) {
+                patch(jump(0xE8), entry);                       // call entry
+            } else {
+                emit(0x48); emit(0xB8); emit64((unsigned long long)&target->native);   // mov rax, &native
+                emit(0xFF); emit(0x10);                         // call [rax]
+            }
+            memory(0x80, 7, R12, STATE(failed)); emit(0);       // cmp byte [r12 + failed], 0
+            returns.push_back(jump(0x0F80 | CC_NE));
+            store(inst.a);
+            break;
+        }
+        case OP_RET:
+            load(inst.a);
+            returns.push_back(jump(0xE9));
+            break;
+        }
+    }
+    offsets[n] = bytes.size();
+
+    size_t fail = bytes.size();
+    memory(0xC6, 0, R12, STATE(failed)); emit(1);       // mov byte [r12 + failed], 1
+    size_t epilogue = bytes.size();
+    memory(0x83, 0, R12, STATE(budget)); emit(1);       // add dword [r12 + budget], 1
+    emit(0x48); emit(0x81); emit(0xC4); emit32(frame);  // add rsp, frame
+    emit(0x41); emit(0x5C);                             // pop r12
+    emit(0x5B);                                         // pop rbx
+    emit(0xC3);                                         // ret
+
+    for (vector<pair<size_t, int> >::iterator iter = branches.begin(); iter != branches.end(); iter++) {
+        patch(iter->first, offsets[iter->second]);
+    }
+    for (vector<size_t>::iterator iter = fails.begin(); iter != fails.end(); iter++) {
+        patch(*iter, fail);
+    }
+    for (vector<size_t>::iterator iter = returns.begin(); iter != returns.end(); iter++) {
+        patch(*iter, epilogue);
+    }
+}
+
+
+// Copies the batch into executable memory and points every function at its code
+bool JIT::install(const vector<FunctionCode *> &batch, const vector<size_t> &entries) {
+#ifdef JIT_SUPPORTED
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (bytes.size() + page - 1) / page * page;
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+        return false;
+    memcpy(block, bytes.data(), bytes.size());
+    if (mprotect(block, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(block, size);
+        return false;
+    }
+    blocks.push_back(make_pair(block, size));
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i]->native = (NativeCode)((char *)block + entries[i]);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+static void printBytes(ostream &out, const vector<unsigned char> &bytes, size_t begin, size_t end) {
+    out << hex << setfill('0');
+    for (size_t i = begin; i < end; i++) {
+        out << setw(2) << (int)bytes[i] << (i + 1 < end ? " " : "");
+    }
+    out << dec << setfill(' ');
+}
+
+void JIT::print(ostream &out, const FunctionCode *function, const vector<size_t> &offsets, size_t entry, size_t end) const {
+    out << "jit " << function->name << " (" << function->nregs << " registers) at " << (const void *)function->native << endl;
+    out << "  prologue\t";
+    printBytes(out, bytes, entry, offsets[0]);
+    out << endl;
+    for (size_t i = 0; i < function->code.size(); i++) {
+        out << "  " << i << "\t" << opcodeInfo[function->code[i].op].name << "\t";
+        printBytes(out, bytes, offsets[i], max(offsets[i], offsets[i + 1]));
+        out << endl;
+    }
+    out << "  epilogue\t";
+    printBytes(out, bytes, offsets.back(), end);
+    out << endl;
+}
+
+
+// Compiles the function with everything it calls; false leaves it to the VM for good
+bool JIT::compile(FunctionCode *function) {
+    if (!available())
+        return false;
+    vector<FunctionCode *> batch;
+    if (!collect(function, batch))
+        return false;
+    bytes.clear();
+    vector<size_t> entries(batch.size());
+    vector<vector<size_t> > offsets(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        entries[i] = bytes.size();
+        assemble(batch[i], offsets[i]);
+    }
+    if (!install(batch, entries))
+        return false;
+    if (dump) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            print(cerr, batch[i], offsets[i], entries[i], i + 1 < batch.size() ? entries[i + 1] : bytes.size());
+        }
+    }
+    return true;
+}
+
+
+// Runs compiled code for one call from the VM, allowed `budget` nested calls including its own
+bool JIT::call(FunctionCode *function, const MyObject *args, int budget, MyObject *value) {
+    JitState state;
+    state.budget = budget;
+    state.failed = 0;
+    state.stackLimit = (const char *)__builtin_frame_address(0) - stackBytes;
+    state.calls = 0;
+    *value = function->native(args, &state);
+    if (state.failed)
+        return false;
+    stats->calls += state.calls;
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef H_JIT
+#define H_JIT
+
+#include <ostream>
+#include <vector>
+#include "interpreter.hpp"
+#include "bytecode.hpp"
+using namespace std;
+
+
+class Stats;
+
+
+// Machine code is only generated on x86-64 hosts that can map executable memory
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_SUPPORTED
+#endif
+
+// Calls a function takes in the VM before it is compiled
+#define JIT_THRESHOLD 10
+
+// Native stack kept for the VM and everything below it, out of the stack of the thread
+// running the VM (taken as 8MB if it cannot be found), when compiled code works out how deep it may go
+#define JIT_STACK_RESERVE (1 << 20)
+#define JIT_STACK_DEFAULT (8 << 20)
+
+
+// Shared by all compiled code while one call from the VM runs
+struct JitState {
+    int budget;                     // nested calls left before maxDepth is exceeded
+    char failed;                    // set when compiled code gave up, its result is then meaningless
+    const char *stackLimit;
+    unsigned long calls;            // made from compiled code
+};
+
+
+// Template compiler from register bytecode to x86-64. Only pure functions
+// whose callees are all pure too are compiled: they cannot print or define
+// anything, so whenever compiled code meets something it does not handle
+// (an undefined variable, too many nested calls) it gives up and the VM
+// simply runs the same call again, which then reports the error.
+// Registers live in the native frame and every instruction loads and stores them.
+class JIT {
+private:
+    Module *module;
+    const vector<int> *bindings;
+    bool dump;
+    size_t stackBytes;                      // native stack compiled code may use before it gives up
+    vector<unsigned char> bytes;            // code of the batch being assembled
+    vector<pair<void *, size_t> > blocks;   // executable mappings, released with the JIT
+    Stats *stats;                           // gets the calls made from compiled code, over every call() that did not give up
+
+    int callee(const Instruction &inst) const;
+    bool collect(FunctionCode *function, vector<FunctionCode *> &batch) const;
+    void assemble(FunctionCode *function, vector<size_t> &offsets);
+    bool install(const vector<FunctionCode *> &batch, const vector<size_t> &entries);
+    void print(ostream &out, const FunctionCode *function, const vector<size_t> &offsets, size_t entry, size_t end) const;
+
+    void emit(int byte);
+    void emit32(int value);
+    void emit64(unsigned long long value);
+    void modrm(int reg, int base, int disp);
+    void memory(int opcode, int reg, int base, int disp, bool wide = false);
+    void load(int reg);
+    void store(int reg);
+    size_t jump(int opcode);
+    void patch(size_t at, size_t target);
+
+public:
+    JIT(Module *module, const vector<int> *bindings, bool dump, Stats *stats);
+    ~JIT();
+
+    static bool available();
+    bool compile(FunctionCode *function);
+    bool call(FunctionCode *function, const MyObject *args, int budget, MyObject *value);
+};
+
+
+#endif /* H_JIT */
@@ -0,0 +1,303 @@
+#include "kernels.hpp"
+#ifdef KERNELS_SIMD
+#include <immintrin.h>
+#endif
+
+
+// One element at a time: the fallback, the tail of every vector loop, and what the vectors must agree with
+
+static inline int32_t addScalar(int32_t a, int32_t b) { return (int32_t)((uint32_t)a + (uint32_t)b); }
+static inline int32_t subScalar(int32_t a, int32_t b) { return (int32_t)((uint32_t)a - (uint32_t)b); }
+static inline int32_t mulScalar(int32_t a, int32_t b) { return (int32_t)((uint32_t)a * (uint32_t)b); }
+static inline int32_t divScalar(int32_t a, int32_t b) { return b == -1 ? (int32_t)(0u - (uint32_t)a) : a / b; }
+static inline double addScalar(double a, double b) { return a + b; }
+static inline double subScalar(double a, double b) { return a - b; }
+static inline double mulScalar(double a, double b) { return a * b; }
+static inline double divScalar(double a, double b) { return a / b; }
+template <class T> static inline int32_t gtScalar(T a, T b) { return a > b; }
+template <class T> static inline int32_t ltScalar(T a, T b) { return a < b; }
+template <class T> static inline int32_t geScalar(T a, T b) { return a >= b; }
+template <class T> static inline int32_t leScalar(T a, T b) { return a <= b; }
+template <class T> static inline int32_t eqScalar(T a, T b) { return a == b; }
+// The same operand wins on a NaN as with the vector instructions
+template <class T> static inline T minScalar(T a, T b) { return a < b ? a : b; }
+template <class T> static inline T maxScalar(T a, T b) { return a > b ? a : b; }
+
+
+#define SCALAR_ELEMENTWISE(name, T, R, scalar) \
+static void name(const T *a, const T *b, R *out, size_t n) { \
+    for (size_t i = 0; i < n; i++) \
+        out[i] = scalar(a[i], b[i]); \
+}
+
+#define SCALAR_REDUCE(name, T, scalar, init) \
+static T name(const T *a, size_t n) { \
+    T result = init; \
+    for (size_t i = 0; i < n; i++) \
+        result = scalar(result, a[i]); \
+    return result; \
+}
+
+#define SCALAR_DOT(name, T) \
+static T name(const T *a, const T *b, size_t n) { \
+    T result = 0; \
+    for (size_t i = 0; i < n; i++) \
+        result = addScalar(result, mulScalar(a[i], b[i])); \
+    return result; \
+}
+
+SCALAR_ELEMENTWISE(addIntsScalar, int32_t, int32_t, addScalar)
+SCALAR_ELEMENTWISE(subIntsScalar, int32_t, int32_t, subScalar)
+SCALAR_ELEMENTWISE(mulIntsScalar, int32_t, int32_t, mulScalar)
+SCALAR_ELEMENTWISE(divIntsScalar, int32_t, int32_t, divScalar)
+SCALAR_ELEMENTWISE(gtIntsScalar, int32_t, int32_t, gtScalar)
+SCALAR_ELEMENTWISE(ltIntsScalar, int32_t, int32_t, ltScalar)
+SCALAR_ELEMENTWISE(geIntsScalar, int32_t, int32_t, geScalar)
+SCALAR_ELEMENTWISE(leIntsScalar, int32_t, int32_t, leScalar)
+SCALAR_ELEMENTWISE(eqIntsScalar, int32_t, int32_t, eqScalar)
+SCALAR_ELEMENTWISE(addDoublesScalar, double, double, addScalar)
+SCALAR_ELEMENTWISE(subDoublesScalar, double, double, subScalar)
+SCALAR_ELEMENTWISE(mulDoublesScalar, double, double, mulScalar)
+SCALAR_ELEMENTWISE(divDoublesScalar, double, double, divScalar)
+SCALAR_ELEMENTWISE(gtDoublesScalar, double, int32_t, gtScalar)
+SCALAR_ELEMENTWISE(ltDoublesScalar, double, int32_t, ltScalar)
+SCALAR_ELEMENTWISE(geDoublesScalar, double, int32_t, geScalar)
+SCALAR_ELEMENTWISE(leDoublesScalar, double, int32_t, leScalar)
+SCALAR_ELEMENTWISE(eqDoublesScalar, double, int32_t, eqScalar)
+SCALAR_REDUCE(sumIntsScalar, int32_t, addScalar, 0)
+SCALAR_REDUCE(sumDoublesScalar, double, addScalar, 0)
+SCALAR_REDUCE(minIntsScalar, int32_t, minScalar, a[0])
+SCALAR_REDUCE(minDoublesScalar, double, minScalar, a[0])
+SCALAR_REDUCE(maxIntsScalar, int32_t, maxScalar, a[0])
+SCALAR_REDUCE(maxDoublesScalar, double, maxScalar, a[0])
+SCALAR_DOT(dotIntsScalar, int32_t)
+SCALAR_DOT(dotDoublesScalar, double)
+
+static const Kernels scalarKernels = {
+    "scalar",
+    {addIntsScalar, subIntsScalar, mulIntsScalar, divIntsScalar,
+     gtIntsScalar, ltIntsScalar, geIntsScalar, leIntsScalar, eqIntsScalar},
+    {addDoublesScalar, subDoublesScalar, mulDoublesScalar, divDoublesScalar},
+    {gtDoublesScalar, ltDoublesScalar, geDoublesScalar, leDoublesScalar, eqDoublesScalar},
+    sumIntsScalar, sumDoublesScalar, minIntsScalar, minDoublesScalar, maxIntsScalar, maxDoublesScalar,
+    dotIntsScalar, dotDoublesScalar,
+};
+
+
+#ifdef KERNELS_SIMD
+
+// Vector loops over `width` lanes of type V, finishing the last elements one by one.
+// The vector operations are inline functions, so that their instruction set is their own.
+
+#define VECTOR_ELEMENTWISE(target, name, T, R, V, width, load, store, vector, scalar) \
+target static void name(const T *a, const T *b, R *out, size_t n) { \
+    size_t i = 0; \
+    for (; i + width <= n; i += width) \
+        store(out + i, vector(load(a + i), load(b + i))); \
+    for (; i < n; i++) \
+        out[i] = scalar(a[i], b[i]); \
+}
+
+// Reductions keep one partial result per lane and fold the lanes together at the end
+#define VECTOR_REDUCE(target, name, T, V, width, load, store, set1, vector, scalar, init) \
+target static T name(const T *a, size_t n) { \
+    T result = init; \
+    size_t i = 0; \
+    if (n >= width) { \
+        V acc = set1(result); \
+        for (; i + width <= n; i += width) \
+            acc = vector(acc, load(a + i)); \
+        T lanes[width]; \
+        store(lanes, acc); \
+        for (int j = 0; j < width; j++) \
+            result = scalar(result, lanes[j]); \
+    } \
+    for (; i < n; i++) \
+        result = scalar(result, a[i]); \
+    return result; \
+}
+
+#define VECTOR_DOT(target, name, T, V, width, load, store, set1, add, mul) \
+target static T name(const T *a, const T *b, size_t n) { \
+    T result = 0; \
+    size_t i = 0; \
+    if (n >= width) { \
+        V acc = set1(0); \
+        for (; i + width <= n; i += width) \
+            acc = add(acc, mul(load(a + i), load(b + i))); \
+        T lanes[width]; \
+        store(lanes, acc); \
+        for (int j = 0; j < width; j++) \
+            result = addScalar(result, lanes[j]); \
+    } \
+    for (; i < n; i++) \
+        result = addScalar(result, mulScalar(a[i], b[i])); \
+    return result; \
+}
+
+
+// SSE2, which every x86-64 CPU has
+
+#define SSE2
+
+static inline __m128i loadInts128(const int32_t *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void storeInts128(int32_t *p, __m128i v) { _mm_storeu_si128((__m128i *)p, v); }
+static inline void storeTwoInts128(int32_t *p, __m128i v) { _mm_storel_epi64((__m128i *)p, v); }
+static inline __m128i oneInts128() { return _mm_set1_epi32(1); }
+
+// SSE2 has no 32-bit multiply: the even and odd lanes are multiplied apart and put back together
+static inline __m128i mulInts128(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+static inline __m128i gtInts128(__m128i a, __m128i b) { return _mm_and_si128(_mm_cmpgt_epi32(a, b), oneInts128()); }
+static inline __m128i ltInts128(__m128i a, __m128i b) { return _mm_and_si128(_mm_cmplt_epi32(a, b), oneInts128()); }
+static inline __m128i geInts128(__m128i a, __m128i b) { return _mm_andnot_si128(_mm_cmplt_epi32(a, b), oneInts128()); }
+static inline __m128i leInts128(__m128i a, __m128i b) { return _mm_andnot_si128(_mm_cmpgt_epi32(a, b), oneInts128()); }
+static inline __m128i eqInts128(__m128i a, __m128i b) { return _mm_and_si128(_mm_cmpeq_epi32(a, b), oneInts128()); }
+static inline __m128i minInts128(__m128i a, __m128i b) {
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, b), _mm_andnot_si128(greater, a));
+}
+static inline __m128i maxInts128(__m128i a, __m128i b) {
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+}
+
+// A true lane is all ones: masking 1.0 with it and truncating gives 0 or 1
+static inline __m128i maskToInts128(__m128d mask) { return _mm_cvttpd_epi32(_mm_and_pd(mask, _mm_set1_pd(1.0))); }
+static inline __m128i gtDoubles128(__m128d a, __m128d b) { return maskToInts128(_mm_cmpgt_pd(a, b)); }
+static inline __m128i ltDoubles128(__m128d a, __m128d b) { return maskToInts128(_mm_cmplt_pd(a, b)); }
+static inline __m128i geDoubles128(__m128d a, __m128d b) { return maskToInts128(_mm_cmpge_pd(a, b)); }
+static inline __m128i leDoubles128(__m128d a, __m128d b) { return maskToInts128(_mm_cmple_pd(a, b)); }
+static inline __m128i eqDoubles128(__m128d a, __m128d b) { return maskToInts128(_mm_cmpeq_pd(a, b)); }
+
+VECTOR_ELEMENTWISE(SSE2, addIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_add_epi32, addScalar)
+VECTOR_ELEMENTWISE(SSE2, subIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_sub_epi32, subScalar)
+VECTOR_ELEMENTWISE(SSE2, mulIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, mulInts128, mulScalar)
+VECTOR_ELEMENTWISE(SSE2, gtIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, gtInts128, gtScalar)
+VECTOR_ELEMENTWISE(SSE2, ltIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, ltInts128, ltScalar)
+VECTOR_ELEMENTWISE(SSE2, geIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, geInts128, geScalar)
+VECTOR_ELEMENTWISE(SSE2, leIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, leInts128, leScalar)
+VECTOR_ELEMENTWISE(SSE2, eqIntsSse2, int32_t, int32_t, __m128i, 4, loadInts128, storeInts128, eqInts128, eqScalar)
+VECTOR_ELEMENTWISE(SSE2, addDoublesSse2, double, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, addScalar)
+VECTOR_ELEMENTWISE(SSE2, subDoublesSse2, double, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, subScalar)
+VECTOR_ELEMENTWISE(SSE2, mulDoublesSse2, double, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, mulScalar)
+VECTOR_ELEMENTWISE(SSE2, divDoublesSse2, double, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd, divScalar)
+VECTOR_ELEMENTWISE(SSE2, gtDoublesSse2, double, int32_t, __m128d, 2, _mm_loadu_pd, storeTwoInts128, gtDoubles128, gtScalar)
+VECTOR_ELEMENTWISE(SSE2, ltDoublesSse2, double, int32_t, __m128d, 2, _mm_loadu_pd, storeTwoInts128, ltDoubles128, ltScalar)
+VECTOR_ELEMENTWISE(SSE2, geDoublesSse2, double, int32_t, __m128d, 2, _mm_loadu_pd, storeTwoInts128, geDoubles128, geScalar)
+VECTOR_ELEMENTWISE(SSE2, leDoublesSse2, double, int32_t, __m128d, 2, _mm_loadu_pd, storeTwoInts128, leDoubles128, leScalar)
+VECTOR_ELEMENTWISE(SSE2, eqDoublesSse2, double, int32_t, __m128d, 2, _mm_loadu_pd, storeTwoInts128, eqDoubles128, eqScalar)
+VECTOR_REDUCE(SSE2, sumIntsSse2, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_set1_epi32, _mm_add_epi32, addScalar, 0)
+VECTOR_REDUCE(SSE2, sumDoublesSse2, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, addScalar, 0)
+VECTOR_REDUCE(SSE2, minIntsSse2, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_set1_epi32, minInts128, minScalar, a[0])
+VECTOR_REDUCE(SSE2, minDoublesSse2, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_min_pd, minScalar, a[0])
+VECTOR_REDUCE(SSE2, maxIntsSse2, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_set1_epi32, maxInts128, maxScalar, a[0])
+VECTOR_REDUCE(SSE2, maxDoublesSse2, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_max_pd, maxScalar, a[0])
+VECTOR_DOT(SSE2, dotIntsSse2, int32_t, __m128i, 4, loadInts128, storeInts128, _mm_set1_epi32, _mm_add_epi32, mulInts128)
+VECTOR_DOT(SSE2, dotDoublesSse2, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd)
+
+static const Kernels sse2Kernels = {
+    "sse2",
+    {addIntsSse2, subIntsSse2, mulIntsSse2, divIntsScalar,
+     gtIntsSse2, ltIntsSse2, geIntsSse2, leIntsSse2, eqIntsSse2},
+    {addDoublesSse2, subDoublesSse2, mulDoublesSse2, divDoublesSse2},
+    {gtDoublesSse2, ltDoublesSse2, geDoublesSse2, leDoublesSse2, eqDoublesSse2},
+    sumIntsSse2, sumDoublesSse2, minIntsSse2, minDoublesSse2, maxIntsSse2, maxDoublesSse2,
+    dotIntsSse2, dotDoublesSse2,
+};
+
+
+// AVX2, compiled for it function by function and only called once the CPU is known to have it
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i loadInts256(const int32_t *p) { return _mm256_loadu_si256((const __m256i *)p); }
+AVX2 static inline void storeInts256(int32_t *p, __m256i v) { _mm256_storeu_si256((__m256i *)p, v); }
+AVX2 static inline void storeFourInts256(int32_t *p, __m128i v) { _mm_storeu_si128((__m128i *)p, v); }
+AVX2 static inline __m256i oneInts256() { return _mm256_set1_epi32(1); }
+
+AVX2 static inline __m256i addInts256(__m256i a, __m256i b) { return _mm256_add_epi32(a, b); }
+AVX2 static inline __m256i subInts256(__m256i a, __m256i b) { return _mm256_sub_epi32(a, b); }
+AVX2 static inline __m256i mulInts256(__m256i a, __m256i b) { return _mm256_mullo_epi32(a, b); }
+AVX2 static inline __m256i gtInts256(__m256i a, __m256i b) { return _mm256_and_si256(_mm256_cmpgt_epi32(a, b), oneInts256()); }
+AVX2 static inline __m256i ltInts256(__m256i a, __m256i b) { return _mm256_and_si256(_mm256_cmpgt_epi32(b, a), oneInts256()); }
+AVX2 static inline __m256i geInts256(__m256i a, __m256i b) { return _mm256_andnot_si256(_mm256_cmpgt_epi32(b, a), oneInts256()); }
+AVX2 static inline __m256i leInts256(__m256i a, __m256i b) { return _mm256_andnot_si256(_mm256_cmpgt_epi32(a, b), oneInts256()); }
+AVX2 static inline __m256i eqInts256(__m256i a, __m256i b) { return _mm256_and_si256(_mm256_cmpeq_epi32(a, b), oneInts256()); }
+AVX2 static inline __m256i minInts256(__m256i a, __m256i b) { return _mm256_min_epi32(a, b); }
+AVX2 static inline __m256i maxInts256(__m256i a, __m256i b) { return _mm256_max_epi32(a, b); }
+AVX2 static inline __m256i setInts256(int32_t value) { return _mm256_set1_epi32(value); }
+
+AVX2 static inline __m256d loadDoubles256(const double *p) { return _mm256_loadu_pd(p); }
+AVX2 static inline void storeDoubles256(double *p, __m256d v) { _mm256_storeu_pd(p, v); }
+AVX2 static inline __m256d addDoubles256(__m256d a, __m256d b) { return _mm256_add_pd(a, b); }
+AVX2 static inline __m256d subDoubles256(__m256d a, __m256d b) { return _mm256_sub_pd(a, b); }
+AVX2 static inline __m256d mulDoubles256(__m256d a, __m256d b) { return _mm256_mul_pd(a, b); }
+AVX2 static inline __m256d divDoubles256(__m256d a, __m256d b) { return _mm256_div_pd(a, b); }
+AVX2 static inline __m256d minDoubles256(__m256d a, __m256d b) { return _mm256_min_pd(a, b); }
+AVX2 static inline __m256d maxDoubles256(__m256d a, __m256d b) { return _mm256_max_pd(a, b); }
+AVX2 static inline __m256d setDoubles256(double value) { return _mm256_set1_pd(value); }
+
+AVX2 static inline __m128i maskToInts256(__m256d mask) { return _mm256_cvttpd_epi32(_mm256_and_pd(mask, _mm256_set1_pd(1.0))); }
+AVX2 static inline __m128i gtDoubles256(__m256d a, __m256d b) { return maskToInts256(_mm256_cmp_pd(a, b, _CMP_GT_OQ)); }
+AVX2 static inline __m128i ltDoubles256(__m256d a, __m256d b) { return maskToInts256(_mm256_cmp_pd(a, b, _CMP_LT_OQ)); }
+AVX2 static inline __m128i geDoubles256(__m256d a, __m256d b) { return maskToInts256(_mm256_cmp_pd(a, b, _CMP_GE_OQ)); }
+AVX2 static inline __m128i leDoubles256(__m256d a, __m256d b) { return maskToInts256(_mm256_cmp_pd(a, b, _CMP_LE_OQ)); }
+AVX2 static inline __m128i eqDoubles256(__m256d a, __m256d b) { return maskToInts256(_mm256_cmp_pd(a, b, _CMP_EQ_OQ)); }
+
+VECTOR_ELEMENTWISE(AVX2, addIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, addInts256, addScalar)
+VECTOR_ELEMENTWISE(AVX2, subIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, subInts256, subScalar)
+VECTOR_ELEMENTWISE(AVX2, mulIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, mulInts256, mulScalar)
+VECTOR_ELEMENTWISE(AVX2, gtIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, gtInts256, gtScalar)
+VECTOR_ELEMENTWISE(AVX2, ltIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, ltInts256, ltScalar)
+VECTOR_ELEMENTWISE(AVX2, geIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, geInts256, geScalar)
+VECTOR_ELEMENTWISE(AVX2, leIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, leInts256, leScalar)
+VECTOR_ELEMENTWISE(AVX2, eqIntsAvx2, int32_t, int32_t, __m256i, 8, loadInts256, storeInts256, eqInts256, eqScalar)
+VECTOR_ELEMENTWISE(AVX2, addDoublesAvx2, double, double, __m256d, 4, loadDoubles256, storeDoubles256, addDoubles256, addScalar)
+VECTOR_ELEMENTWISE(AVX2, subDoublesAvx2, double, double, __m256d, 4, loadDoubles256, storeDoubles256, subDoubles256, subScalar)
+VECTOR_ELEMENTWISE(AVX2, mulDoublesAvx2, double, double, __m256d, 4, loadDoubles256, storeDoubles256, mulDoubles256, mulScalar)
+VECTOR_ELEMENTWISE(AVX2, divDoublesAvx2, double, double, __m256d, 4, loadDoubles256, storeDoubles256, divDoubles256, divScalar)
+VECTOR_ELEMENTWISE(AVX2, gtDoublesAvx2, double, int32_t, __m256d, 4, loadDoubles256, storeFourInts256, gtDoubles256, gtScalar)
+VECTOR_ELEMENTWISE(AVX2, ltDoublesAvx2, double, int32_t, __m256d, 4, loadDoubles256, storeFourInts256, ltDoubles256, ltScalar)
+VECTOR_ELEMENTWISE(AVX2, geDoublesAvx2, double, int32_t, __m256d, 4, loadDoubles256, storeFourInts256, geDoubles256, geScalar)
+VECTOR_ELEMENTWISE(AVX2, leDoublesAvx2, double, int32_t, __m256d, 4, loadDoubles256, storeFourInts256, leDoubles256, leScalar)
+VECTOR_ELEMENTWISE(AVX2, eqDoublesAvx2, double, int32_t, __m256d, 4, loadDoubles256, storeFourInts256, eqDoubles256, eqScalar)
+VECTOR_REDUCE(AVX2, sumIntsAvx2, int32_t, __m256i, 8, loadInts256, storeInts256, setInts256, addInts256, addScalar, 0)
+VECTOR_REDUCE(AVX2, sumDoublesAvx2, double, __m256d, 4, loadDoubles256, storeDoubles256, setDoubles256, addDoubles256, addScalar, 0)
+VECTOR_REDUCE(AVX2, minIntsAvx2, int32_t, __m256i, 8, loadInts256, storeInts256, setInts256, minInts256, minScalar, a[0])
+VECTOR_REDUCE(AVX2, minDoublesAvx2, double, __m256d, 4, loadDoubles256, storeDoubles256, setDoubles256, minDoubles256, minScalar, a[0])
+VECTOR_REDUCE(AVX2, maxIntsAvx2, int32_t, __m256i, 8, loadInts256, storeInts256, setInts256, maxInts256, maxScalar, a[0])
+VECTOR_REDUCE(AVX2, maxDoublesAvx2, double, __m256d, 4, loadDoubles256, storeDoubles256, setDoubles256, maxDoubles256, maxScalar, a[0])
+VECTOR_DOT(AVX2, dotIntsAvx2, int32_t, __m256i, 8, loadInts256, storeInts256, setInts256, addInts256, mulInts256)
+VECTOR_DOT(AVX2, dotDoublesAvx2, double, __m256d, 4, loadDoubles256, storeDoubles256, setDoubles256, addDoubles256, mulDoubles256)
+
+static const Kernels avx2Kernels = {
+    "avx2",
+    {addIntsAvx2, subIntsAvx2, mulIntsAvx2, divIntsScalar,
+     gtIntsAvx2, ltIntsAvx2, geIntsAvx2, leIntsAvx2, eqIntsAvx2},
+    {addDoublesAvx2, subDoublesAvx2, mulDoublesAvx2, divDoublesAvx2},
+    {gtDoublesAvx2, ltDoublesAvx2, geDoublesAvx2, leDoublesAvx2, eqDoublesAvx2},
+    sumIntsAvx2, sumDoublesAvx2, minIntsAvx2, minDoublesAvx2, maxIntsAvx2, maxDoublesAvx2,
+    dotIntsAvx2, dotDoublesAvx2,
+};
+
+
+static const Kernels &best() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? avx2Kernels : sse2Kernels;
+}
+
+#endif /* KERNELS_SIMD */
+
+
+const Kernels &kernels() {
+#ifdef KERNELS_SIMD
+    static const Kernels &picked = best();
+    return picked;
+#else
+    return scalarKernels;
+#endif
+}
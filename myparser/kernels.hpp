@@ -0,0 +1,59 @@
+#ifndef H_KERNELS
+#define H_KERNELS
+
+#include <stddef.h>
+#include <stdint.h>
+using namespace std;
+
+
+// Vector code is only built for x86-64, where SSE2 is always there and AVX2 is checked at run time.
+// make DEBUG=-DNO_SIMD keeps the plain loops everywhere.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+#define KERNELS_SIMD
+#endif
+
+
+// In the order of the COMPARE_ codes from KERNEL_GT on
+enum KernelOp {
+    KERNEL_ADD,
+    KERNEL_SUB,
+    KERNEL_MUL,
+    KERNEL_DIV,
+    KERNEL_GT,
+    KERNEL_LT,
+    KERNEL_GE,
+    KERNEL_LE,
+    KERNEL_EQ,
+    KERNEL_OPS,
+};
+
+
+// out[i] = a[i] op b[i] for i < n. Int arithmetic wraps around, INT_MIN / -1
+// included, comparisons write 0 or 1, and int division must be given no zero divisor.
+typedef void (*IntKernel)(const int32_t *a, const int32_t *b, int32_t *out, size_t n);
+typedef void (*DoubleKernel)(const double *a, const double *b, double *out, size_t n);
+typedef void (*DoubleCompareKernel)(const double *a, const double *b, int32_t *out, size_t n);
+
+// The loops over arrays for one instruction set. Reductions over doubles
+// add in a different order on each, so their last bits may differ.
+// min and max need at least one element.
+struct Kernels {
+    const char *name;
+    IntKernel ints[KERNEL_OPS];
+    DoubleKernel doubles[KERNEL_GT];
+    DoubleCompareKernel doubleCompares[KERNEL_OPS - KERNEL_GT];
+    int32_t (*sumInts)(const int32_t *a, size_t n);
+    double (*sumDoubles)(const double *a, size_t n);
+    int32_t (*minInts)(const int32_t *a, size_t n);
+    double (*minDoubles)(const double *a, size_t n);
+    int32_t (*maxInts)(const int32_t *a, size_t n);
+    double (*maxDoubles)(const double *a, size_t n);
+    int32_t (*dotInts)(const int32_t *a, const int32_t *b, size_t n);
+    double (*dotDoubles)(const double *a, const double *b, size_t n);
+};
+
+// The widest the CPU supports, picked on first use
+const Kernels &kernels();
+
+
+#endif /* H_KERNELS */
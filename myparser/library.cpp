@@ -0,0 +1,212 @@
+#include "library.hpp"
+#include "array.hpp"
+#include "interpreter.hpp"
+#include <climits>
+#include <cmath>
+
+
+static StringException typeError(const char *what, MyObject value) {
+    return StringException(string("Type error: ") + what + " of " + value.typeName());
+}
+
+
+// Math. Ints stay ints, wrapping around like the operators, unless a double comes in.
+
+static uint32_t magnitude(int a) {
+    return a < 0 ? 0u - (uint32_t)a : a;
+}
+
+static MyObject absolute(MyObject value) {
+    if (value.isInt())
+        return MyObject((int)magnitude(value.getInt()));
+    if (value.isDouble())
+        return MyObject::fromDouble(fabs(value.getDouble()));
+    throw typeError("abs", value);
+}
+
+// Of the numbers given, or of the elements of a single array
+static MyObject extreme(const char *what, bool greatest, const MyObject *args, int nargs) {
+    if (nargs == 1 && args[0].isArray())
+        return greatest ? arrayMax(args, nargs) : arrayMin(args, nargs);
+    if (nargs == 0)
+        throw StringException(string("Function ") + what + " takes at least 1 argument");
+    MyObject best = args[0];
+    for (int i = 0; i < nargs; i++) {
+        if (!args[i].isNumber())
+            throw typeError(what, args[i]);
+        if (i > 0 && (greatest ? objectGreater(args[i], best) : objectLess(args[i], best)).truthy())
+            best = args[i];
+    }
+    return best;
+}
+
+static MyObject minimum(const MyObject *args, int nargs) {
+    return extreme("min", false, args, nargs);
+}
+
+static MyObject maximum(const MyObject *args, int nargs) {
+    return extreme("max", true, args, nargs);
+}
+
+// By squaring for an int to a power of 0 or more, through the C library otherwise
+static MyObject power(MyObject base, MyObject exponent) {
+    if (!base.isNumber())
+        throw typeError("pow", base);
+    if (!exponent.isNumber())
+        throw typeError("pow", exponent);
+    if (!MyObject::bothInts(base, exponent) || exponent.getInt() < 0)
+        return MyObject::fromDouble(pow(base.toDouble(), exponent.toDouble()));
+    uint32_t result = 1, factor = base.getInt();
+    for (uint32_t n = exponent.getInt(); n > 0; n >>= 1) {
+        if (n & 1)
+            result *= factor;
+        factor *= factor;
+    }
+    return MyObject((int)result);
+}
+
+static int gcd(int a, int b) {
+    uint32_t x = magnitude(a), y = magnitude(b);
+    while (y != 0) {
+        uint32_t r = x % y;
+        x = y;
+        y = r;
+    }
+    return x;
+}
+
+static int lcm(int a, int b) {
+    uint32_t divisor = gcd(a, b);
+    return divisor == 0 ? 0 : (int)(magnitude(a) / divisor * magnitude(b));
+}
+
+// Takes the sign of the divisor, as in Python
+static int mod(int a, int b) {
+    if (b == 0)
+        throw StringException("Division by zero");
+    if (b == -1)
+        return 0;
+    int r = a % b;
+    return r != 0 && (r < 0) != (b < 0) ? r + b : r;
+}
+
+// Truncates toward zero
+static int toInt(double value) {
+    if (!(value > (double)INT_MIN - 1 && value < (double)INT_MAX + 1))
+        throw StringException("int of a float out of range");
+    return (int)value;
+}
+
+static double toFloat(double value) {
+    return value;
+}
+
+static double squareRoot(double value) {
+    return sqrt(value);
+}
+
+static double exponential(double value) {
+    return exp(value);
+}
+
+static double logarithm(double value) {
+    return log(value);
+}
+
+static double sine(double value) {
+    return sin(value);
+}
+
+static double cosine(double value) {
+    return cos(value);
+}
+
+static double roundDown(double value) {
+    return floor(value);
+}
+
+static double roundUp(double value) {
+    return ceil(value);
+}
+
+
+// Bits of 32-bit ints. Shift counts are taken modulo 32, and shr keeps the sign.
+
+static int bitAnd(int a, int b) {
+    return a & b;
+}
+
+static int bitOr(int a, int b) {
+    return a | b;
+}
+
+static int bitXor(int a, int b) {
+    return a ^ b;
+}
+
+static int bitNot(int a) {
+    return ~a;
+}
+
+static int shiftLeft(int a, int n) {
+    return (int)((uint32_t)a << (n & 31));
+}
+
+static int shiftRight(int a, int n) {
+    return a >> (n & 31);
+}
+
+static int shiftRightUnsigned(int a, int n) {
+    return (int)((uint32_t)a >> (n & 31));
+}
+
+static int popcount(int a) {
+    return __builtin_popcount((uint32_t)a);
+}
+
+static int leadingZeros(int a) {
+    return a == 0 ? 32 : __builtin_clz((uint32_t)a);
+}
+
+static int trailingZeros(int a) {
+    return a == 0 ? 32 : __builtin_ctz((uint32_t)a);
+}
+
+
+void addLibrary(Natives &natives) {
+    natives.add(NATIVE_ARRAY, -1, arrayLiteral);
+    natives.add(NATIVE_INDEX, 2, arrayIndex);
+    natives.add(NATIVE_SLICE, 3, arraySlice);
+    natives.add("len", 1, arrayLength);
+    natives.add("sum", 1, arraySum);
+    natives.add("dot", 2, arrayDot);
+    natives.add("range", 1, arrayRange);
+
+    natives.add("abs", absolute);
+    natives.add("min", -1, minimum);
+    natives.add("max", -1, maximum);
+    natives.add("pow", power);
+    natives.add("gcd", gcd);
+    natives.add("lcm", lcm);
+    natives.add("mod", mod);
+    natives.add("int", toInt);
+    natives.add("float", toFloat);
+    natives.add("sqrt", squareRoot);
+    natives.add("exp", exponential);
+    natives.add("log", logarithm);
+    natives.add("sin", sine);
+    natives.add("cos", cosine);
+    natives.add("floor", roundDown);
+    natives.add("ceil", roundUp);
+
+    natives.add("band", bitAnd);
+    natives.add("bor", bitOr);
+    natives.add("bxor", bitXor);
+    natives.add("bnot", bitNot);
+    natives.add("shl", shiftLeft);
+    natives.add("shr", shiftRight);
+    natives.add("ushr", shiftRightUnsigned);
+    natives.add("popcount", popcount);
+    natives.add("clz", leadingZeros);
+    natives.add("ctz", trailingZeros);
+}
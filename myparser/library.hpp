@@ -0,0 +1,12 @@
+#ifndef H_LIBRARY
+#define H_LIBRARY
+
+#include "natives.hpp"
+using namespace std;
+
+
+// The natives every interpreter starts with: the array functions, math and bit operations
+void addLibrary(Natives &natives);
+
+
+#endif /* H_LIBRARY */
@@ -0,0 +1,61 @@
+#include "memo.hpp"
+
+
+size_t MemoTable::Hash::operator()(const vector<MyObject> &args) const {
+    size_t h = args.size();
+    for (vector<MyObject>::const_iterator iter = args.begin(); iter != args.end(); iter++) {
+        h = h * 1000003 ^ (size_t)iter->getBits();
+    }
+    return h;
+}
+
+bool MemoTable::Equal::operator()(const vector<MyObject> &left, const vector<MyObject> &right) const {
+    if (left.size() != right.size())
+        return false;
+    for (size_t i = 0; i < left.size(); i++) {
+        if (left[i].getBits() != right[i].getBits())
+            return false;
+    }
+    return true;
+}
+
+
+MemoTable::MemoTable(const string &name, int nargs, size_t capacity)
+    : key(nargs), capacity(capacity), name(name), nargs(nargs), hits(0), misses(0) {}
+
+
+bool MemoTable::lookup(const MyObject *args, MyObject *value) {
+    key.assign(args, args + nargs);
+    auto iter = index.find(key);
+    if (iter == index.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    entries.splice(entries.begin(), entries, iter->second);
+    *value = iter->second->value;
+    return true;
+}
+
+
+void MemoTable::store(const MyObject *args, MyObject value) {
+    key.assign(args, args + nargs);
+    auto iter = index.find(key);
+    if (iter != index.end()) {
+        iter->second->value = value;
+        entries.splice(entries.begin(), entries, iter->second);
+        return;
+    }
+    if (entries.size() >= capacity) {
+        index.erase(entries.back().args);
+        entries.pop_back();
+    }
+    Entry entry = {key, value};
+    entries.push_front(entry);
+    index[key] = entries.begin();
+}
+
+
+void MemoTable::report(ostream &out) const {
+    out << "memo " << name << ": " << hits << " hits, " << misses << " misses, " << entries.size() << " entries" << endl;
+}
@@ -0,0 +1,46 @@
+#ifndef H_MEMO
+#define H_MEMO
+
+#include <list>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "interpreter.hpp"
+using namespace std;
+
+
+// Results of one pure function by argument tuple. Beyond `capacity` entries
+// the least recently used one is dropped.
+class MemoTable {
+private:
+    struct Entry {
+        vector<MyObject> args;
+        MyObject value;
+    };
+    struct Hash {
+        size_t operator()(const vector<MyObject> &args) const;
+    };
+    // Arguments match bit for bit: 1 and 1.0 may well give different results
+    struct Equal {
+        bool operator()(const vector<MyObject> &left, const vector<MyObject> &right) const;
+    };
+
+    list<Entry> entries;                // most recently used first
+    unordered_map<vector<MyObject>, list<Entry>::iterator, Hash, Equal> index;
+    vector<MyObject> key;               // reused to look arguments up without allocating
+    size_t capacity;
+
+public:
+    const string name;
+    const int nargs;
+    unsigned long hits, misses;
+
+    MemoTable(const string &name, int nargs, size_t capacity);
+    bool lookup(const MyObject *args, MyObject *value);
+    void store(const MyObject *args, MyObject value);
+    void report(ostream &out) const;
+};
+
+
+#endif /* H_MEMO */
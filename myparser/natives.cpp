@@ -0,0 +1,47 @@
+#include "natives.hpp"
+#include "interpreter.hpp"
+#include <sstream>
+
+
+int NativeArgument<int>::get(const NativeFunction *fn, MyObject value) {
+    if (!value.isInt())
+        throw StringException("Type error: " + fn->name + " of " + value.typeName());
+    return value.getInt();
+}
+
+double NativeArgument<double>::get(const NativeFunction *fn, MyObject value) {
+    if (!value.isNumber())
+        throw StringException("Type error: " + fn->name + " of " + value.typeName());
+    return value.toDouble();
+}
+
+
+static MyObject invokeCall(const NativeFunction *fn, const MyObject *args, int nargs) {
+    return ((NativeCall)fn->function)(args, nargs);
+}
+
+void Natives::add(const string &name, int arity, NativeCall call, bool pure) {
+    add(name, arity, pure, &invokeCall, (void (*)())call);
+}
+
+// A name added again replaces the earlier function
+void Natives::add(const string &name, int arity, bool pure, MyObject (*invoke)(const NativeFunction *, const MyObject *, int), void (*function)()) {
+    NativeFunction &fn = functions[name];
+    fn.name = name;
+    fn.arity = arity;
+    fn.pure = pure;
+    fn.invoke = invoke;
+    fn.function = function;
+}
+
+const NativeFunction *Natives::find(const string &name) const {
+    auto iter = functions.find(name);
+    return iter == functions.end() ? NULL : &iter->second;
+}
+
+
+void nativeArityError(const NativeFunction *fn, int nargs) {
+    stringstream ss;
+    ss << "Function " << fn->name << " takes " << fn->arity << " arguments, " << nargs << " given";
+    throw StringException(ss.str());
+}
@@ -0,0 +1,122 @@
+#ifndef H_NATIVES
+#define H_NATIVES
+
+#include <map>
+#include <string>
+#include "object.hpp"
+using namespace std;
+
+
+// Names the parser gives the calls behind the array syntax, which no script function can have
+#define NATIVE_ARRAY "[...]"            // [a, b, ...]
+#define NATIVE_INDEX "[]"               // a[i]
+#define NATIVE_SLICE "[:]"              // a[begin:end]
+
+
+// Takes the arguments as they are, however many the call passes
+typedef MyObject (*NativeCall)(const MyObject *args, int nargs);
+
+// A function written in C++ that scripts call by name. It runs right where it
+// is called, without a frame, and returns its value or throws a StringException.
+struct NativeFunction {
+    string name;
+    int arity;                          // -1 for any number of arguments
+    bool pure;                          // false if it prints or has any other effect
+    MyObject (*invoke)(const NativeFunction *fn, const MyObject *args, int nargs);
+    void (*function)();                 // what invoke calls, cast back to its own type
+};
+
+
+// Converts the arguments of a deduced signature. int takes ints only, double
+// any number, and MyObject anything.
+template <class T>
+struct NativeArgument;
+
+template <>
+struct NativeArgument<int> {
+    static int get(const NativeFunction *fn, MyObject value);
+};
+
+template <>
+struct NativeArgument<double> {
+    static double get(const NativeFunction *fn, MyObject value);
+};
+
+template <>
+struct NativeArgument<MyObject> {
+    static MyObject get(const NativeFunction *fn, MyObject value) {
+        return value;
+    }
+};
+
+inline MyObject nativeResult(int value) {
+    return MyObject(value);
+}
+
+inline MyObject nativeResult(bool value) {
+    return MyObject((int)value);
+}
+
+inline MyObject nativeResult(double value) {
+    return MyObject::fromDouble(value);
+}
+
+inline MyObject nativeResult(MyObject value) {
+    return value;
+}
+
+template <int... I>
+struct NativeIndices {};
+
+template <int N, int... I>
+struct MakeNativeIndices : MakeNativeIndices<N - 1, N - 1, I...> {};
+
+template <int... I>
+struct MakeNativeIndices<0, I...> {
+    typedef NativeIndices<I...> type;
+};
+
+template <class R, class... Args, int... I>
+MyObject invokeIndexed(const NativeFunction *fn, const MyObject *args, NativeIndices<I...>) {
+    R (*function)(Args...) = (R (*)(Args...))fn->function;
+    return nativeResult(function(NativeArgument<Args>::get(fn, args[I])...));
+}
+
+template <class R, class... Args>
+MyObject invokeDeduced(const NativeFunction *fn, const MyObject *args, int nargs) {
+    return invokeIndexed<R, Args...>(fn, args, typename MakeNativeIndices<sizeof...(Args)>::type());
+}
+
+
+// The natives an interpreter binds calls to. Add them before it runs: call
+// sites keep pointers to the entries, which never move once added.
+class Natives {
+private:
+    map<string, NativeFunction> functions;
+
+    void add(const string &name, int arity, bool pure, MyObject (*invoke)(const NativeFunction *, const MyObject *, int), void (*function)());
+
+public:
+    void add(const string &name, int arity, NativeCall call, bool pure = true);
+
+    // The arity and argument conversions follow from the signature, e.g. int gcd(int, int)
+    template <class R, class... Args>
+    void add(const string &name, R (*function)(Args...), bool pure = true) {
+        add(name, sizeof...(Args), pure, &invokeDeduced<R, Args...>, (void (*)())function);
+    }
+
+    // NULL if there is none by that name
+    const NativeFunction *find(const string &name) const;
+};
+
+
+void nativeArityError(const NativeFunction *fn, int nargs);
+
+inline MyObject callNative(const NativeFunction *fn, const MyObject *args, int nargs) {
+    if (fn->arity >= 0 && fn->arity != nargs)
+        nativeArityError(fn, nargs);
+    return fn->invoke(fn, args, nargs);
+}
+
+
+#endif /* H_NATIVES */
@@ -0,0 +1,244 @@
+#include "object.hpp"
+#include "arena.hpp"
+#include "array.hpp"
+#include "interpreter.hpp"
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdio.h>
+
+
+const MyString *MyString::make(const char *chars, size_t length) {
+    MyString *string = (MyString *)Arena::allocateNode(offsetof(MyString, chars) + length + 1, NULL);
+    string->length = length;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+
+// Elements start on a 32-byte boundary, where the widest vector loads are fastest
+MyArray *MyArray::make(int type, size_t length) {
+    size_t size = type == ARRAY_INT ? sizeof(int32_t) : sizeof(double);
+    MyArray *array = (MyArray *)Arena::allocateNode(sizeof(MyArray) + 31 + length * size, NULL);
+    array->type = type;
+    array->length = length;
+    array->data = (void *)(((uintptr_t)(array + 1) + 31) & ~(uintptr_t)31);
+    return array;
+}
+
+const MyArray *MyArray::slice(const MyArray *array, size_t begin, size_t end) {
+    MyArray *slice = (MyArray *)Arena::allocateNode(sizeof(MyArray), NULL);
+    size_t size = array->type == ARRAY_INT ? sizeof(int32_t) : sizeof(double);
+    slice->type = array->type;
+    slice->length = end - begin;
+    slice->data = (char *)array->data + begin * size;
+    return slice;
+}
+
+
+MyObject MyObject::fromDouble(double value) {
+    // Every NaN becomes the one quiet NaN, leaving the top patterns for the tags
+    if (value != value)
+        value = NAN;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return fromBits(bits + OBJECT_DOUBLE_OFFSET);
+}
+
+MyObject MyObject::fromString(const MyString *string) {
+    return fromBits((uint64_t)(uintptr_t)string | OBJECT_STRING_TAG);
+}
+
+MyObject MyObject::fromArray(const MyArray *array) {
+    return fromBits((uint64_t)(uintptr_t)array | OBJECT_STRING_TAG | OBJECT_ARRAY_BIT);
+}
+
+MyObject MyObject::fromBits(uint64_t bits) {
+    MyObject value;
+    value.bits = bits;
+    return value;
+}
+
+
+double MyObject::getDouble() const {
+    uint64_t raw = bits - OBJECT_DOUBLE_OFFSET;
+    double value;
+    memcpy(&value, &raw, sizeof(value));
+    return value;
+}
+
+const MyString *MyObject::getString() const {
+    return (const MyString *)(uintptr_t)(bits & (OBJECT_STRING_TAG - 1));
+}
+
+const MyArray *MyObject::getArray() const {
+    return (const MyArray *)(uintptr_t)(bits & (OBJECT_STRING_TAG - 1) & ~(uint64_t)OBJECT_ARRAY_BIT);
+}
+
+double MyObject::toDouble() const {
+    return isInt() ? getInt() : getDouble();
+}
+
+const char *MyObject::typeName() const {
+    return isInt() ? "int" : isDouble() ? "float" : isString() ? "string" : "array";
+}
+
+
+bool MyObject::truthySlow() const {
+    if (isDouble())
+        return getDouble() != 0;
+    if (isArray())
+        return getArray()->length != 0;
+    return getString()->length != 0;
+}
+
+
+// Digits written back to front, skipping the locale and padding of operator<<,
+// which print loops spend most of their time in
+static void printInt(ostream &out, int value) {
+    char text[12];
+    char *end = text + sizeof(text), *p = end;
+    uint32_t n = value < 0 ? 0u - (uint32_t)value : value;
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    if (value < 0)
+        *--p = '-';
+    out.write(p, end - p);
+}
+
+// Floats always show a decimal point or an exponent, so they never read as ints
+static void printDouble(ostream &out, double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.14g", value);
+    out << text;
+    if (!strpbrk(text, ".eni"))
+        out << ".0";
+}
+
+ostream &operator<<(ostream &out, MyObject value) {
+    if (value.isInt()) {
+        printInt(out, value.getInt());
+    } else if (value.isDouble()) {
+        printDouble(out, value.getDouble());
+    } else if (value.isString()) {
+        out.write(value.getString()->chars, value.getString()->length);
+    } else {
+        const MyArray *array = value.getArray();
+        out << "[";
+        for (size_t i = 0; i < array->length; i++) {
+            if (i > 0)
+                out << ", ";
+            if (array->type == ARRAY_INT)
+                printInt(out, array->ints()[i]);
+            else
+                printDouble(out, array->doubles()[i]);
+        }
+        out << "]";
+    }
+    return out;
+}
+
+
+static StringException typeError(MyObject left, const char *op, MyObject right) {
+    return StringException(string("Type error: ") + left.typeName() + " " + op + " " + right.typeName());
+}
+
+
+MyObject objectAddSlow(MyObject left, MyObject right) {
+    if (left.isString() || right.isString()) {
+        stringstream ss;
+        ss << left << right;
+        string joined = ss.str();
+        return MyObject::fromString(MyString::make(joined.data(), joined.size()));
+    }
+    if (left.isArray() || right.isArray())
+        return arrayBinary(KERNEL_ADD, left, right);
+    return MyObject::fromDouble(left.toDouble() + right.toDouble());
+}
+
+MyObject objectSubtractSlow(MyObject left, MyObject right) {
+    if (left.isString() || right.isString())
+        throw typeError(left, "-", right);
+    if (left.isArray() || right.isArray())
+        return arrayBinary(KERNEL_SUB, left, right);
+    return MyObject::fromDouble(left.toDouble() - right.toDouble());
+}
+
+MyObject objectMultiplySlow(MyObject left, MyObject right) {
+    if (left.isString() || right.isString())
+        throw typeError(left, "*", right);
+    if (left.isArray() || right.isArray())
+        return arrayBinary(KERNEL_MUL, left, right);
+    return MyObject::fromDouble(left.toDouble() * right.toDouble());
+}
+
+MyObject objectDivideSlow(MyObject left, MyObject right) {
+    if (left.isString() || right.isString())
+        throw typeError(left, "/", right);
+    if (left.isArray() || right.isArray())
+        return arrayBinary(KERNEL_DIV, left, right);
+    if (MyObject::bothInts(left, right)) {
+        if (right.getInt() == 0)
+            throw StringException("Division by zero");
+        return MyObject((int)(0u - (uint32_t)left.getInt()));  // INT_MIN / -1 wraps around
+    }
+    return MyObject::fromDouble(left.toDouble() / right.toDouble());
+}
+
+
+// Numbers compare by value, strings by their bytes; a NaN is unordered with everything
+MyObject objectCompareSlow(MyObject left, MyObject right, int op) {
+    static const char *names[] = {">", "<", ">=", "<="};
+    double l, r;
+    if (!left.isString() && !right.isString() && (left.isArray() || right.isArray())) {
+        return arrayBinary(KERNEL_GT + op, left, right);
+    } else if (left.isString() && right.isString()) {
+        const MyString *a = left.getString(), *b = right.getString();
+        int order = memcmp(a->chars, b->chars, min(a->length, b->length));
+        if (order == 0)
+            order = a->length < b->length ? -1 : a->length > b->length;
+        l = order;
+        r = 0;
+    } else if (!left.isNumber() || !right.isNumber()) {
+        throw typeError(left, names[op], right);
+    } else {
+        l = left.toDouble();
+        r = right.toDouble();
+    }
+    switch (op) {
+    case COMPARE_GT: return l > r;
+    case COMPARE_LT: return l < r;
+    case COMPARE_GE: return l >= r;
+    default: return l <= r;
+    }
+}
+
+// A string never equals a number, nor an array
+MyObject objectEqualSlow(MyObject left, MyObject right) {
+    if (left.isString() && right.isString()) {
+        const MyString *a = left.getString(), *b = right.getString();
+        return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+    }
+    if (left.isString() || right.isString())
+        return false;
+    if (left.isArray() || right.isArray())
+        return arrayBinary(KERNEL_EQ, left, right);
+    return left.toDouble() == right.toDouble();
+}
+
+
+MyObject parseStringLiteral(const char *text, size_t length) {
+    string chars;
+    for (size_t i = 1; i + 1 < length; i++) {
+        if (text[i] == '\\' && i + 2 < length) {
+            char c = text[++i];
+            chars += c == 'n' ? '\n' : c == 't' ? '\t' : c;
+        } else {
+            chars += text[i];
+        }
+    }
+    return MyObject::fromString(MyString::make(chars.data(), chars.size()));
+}
@@ -0,0 +1,186 @@
+#ifndef H_OBJECT
+#define H_OBJECT
+
+#include <limits.h>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+using namespace std;
+
+
+// Doubles are stored as their bits plus this, strings and arrays as a pointer under the tag
+#define OBJECT_DOUBLE_OFFSET ((uint64_t)1 << 49)
+#define OBJECT_STRING_TAG ((uint64_t)1 << 48)
+#define OBJECT_ARRAY_BIT 1              // set in the pointer of an array, which is 8-byte aligned
+
+
+// The characters of a string value, never changed once made. They are
+// allocated in the arena in scope: a literal's in its program, a string
+// built while running in the interpreter that built it.
+struct MyString {
+    size_t length;
+    char chars[1];                      // length of them, then a NUL
+
+    static const MyString *make(const char *chars, size_t length);
+};
+
+
+#define ARRAY_INT 0
+#define ARRAY_DOUBLE 1
+
+// Numbers of one type laid out one after another. Like a string it never
+// changes once filled, so a slice shares the elements it was cut from.
+struct MyArray {
+    int type;                           // ARRAY_INT or ARRAY_DOUBLE
+    size_t length;
+    void *data;                         // 32-byte aligned unless a slice
+
+    static MyArray *make(int type, size_t length);     // elements left to fill
+    static const MyArray *slice(const MyArray *array, size_t begin, size_t end);
+
+    int32_t *ints() const {
+        return (int32_t *)data;
+    }
+    double *doubles() const {
+        return (double *)data;
+    }
+};
+
+
+// A value in one 64-bit word, copied as a plain integer.
+//  int     the 32 bits of the value, upper half zero: a zeroed slot holds 0
+//  double  its bits plus 2^49, which keeps the top 16 bits at 2 or more once NaNs are made canonical
+//  string  the pointer with 1 in the top 16 bits
+//  array   the same with the lowest bit set
+// The operators below test both operands in one go and stay inline while
+// both are ints; anything else takes the out of line path.
+class MyObject {
+private:
+    uint64_t bits;
+
+public:
+    MyObject() = default;
+    MyObject(int value) : bits((uint32_t)value) {}
+    static MyObject fromDouble(double value);
+    static MyObject fromString(const MyString *string);
+    static MyObject fromArray(const MyArray *array);
+    static MyObject fromBits(uint64_t bits);
+
+    bool isInt() const {
+        return bits >> 32 == 0;
+    }
+    bool isDouble() const {
+        return bits >= OBJECT_DOUBLE_OFFSET;
+    }
+    bool isNumber() const {
+        return bits >> 48 != 1;
+    }
+    bool isString() const {
+        return bits >> 48 == 1 && !(bits & OBJECT_ARRAY_BIT);
+    }
+    bool isArray() const {
+        return bits >> 48 == 1 && (bits & OBJECT_ARRAY_BIT);
+    }
+    int getInt() const {
+        return (int32_t)(uint32_t)bits;
+    }
+    double getDouble() const;
+    const MyString *getString() const;
+    const MyArray *getArray() const;
+    double toDouble() const;            // of an int or a double
+    uint64_t getBits() const {
+        return bits;
+    }
+    const char *typeName() const;
+
+    bool truthy() const {
+        return isInt() ? bits != 0 : truthySlow();
+    }
+    bool truthySlow() const;
+
+    static bool bothInts(MyObject left, MyObject right) {
+        return (left.bits | right.bits) >> 32 == 0;
+    }
+};
+
+ostream &operator<<(ostream &out, MyObject value);
+
+
+#define COMPARE_GT 0
+#define COMPARE_LT 1
+#define COMPARE_GE 2
+#define COMPARE_LE 3
+
+
+// The operators of the language. Arithmetic on ints wraps around; mixing in a
+// double gives a double; + joins the printed forms when either side is a
+// string. Comparisons give 0 or 1. With an array on either side they apply
+// element by element (see array.hpp). Anything else throws a StringException.
+MyObject objectAddSlow(MyObject left, MyObject right);
+MyObject objectSubtractSlow(MyObject left, MyObject right);
+MyObject objectMultiplySlow(MyObject left, MyObject right);
+MyObject objectDivideSlow(MyObject left, MyObject right);
+MyObject objectCompareSlow(MyObject left, MyObject right, int op);  // op is a COMPARE_ code
+MyObject objectEqualSlow(MyObject left, MyObject right);
+
+inline MyObject objectAdd(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject((int)((uint32_t)left.getInt() + (uint32_t)right.getInt()));
+    return objectAddSlow(left, right);
+}
+
+inline MyObject objectSubtract(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject((int)((uint32_t)left.getInt() - (uint32_t)right.getInt()));
+    return objectSubtractSlow(left, right);
+}
+
+inline MyObject objectMultiply(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject((int)((uint32_t)left.getInt() * (uint32_t)right.getInt()));
+    return objectMultiplySlow(left, right);
+}
+
+// A zero divisor and INT_MIN / -1, which the CPU would trap on, take the slow path
+inline MyObject objectDivide(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right) && right.getInt() != 0 && (right.getInt() != -1 || left.getInt() != INT_MIN))
+        return MyObject(left.getInt() / right.getInt());
+    return objectDivideSlow(left, right);
+}
+
+inline MyObject objectGreater(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject(left.getInt() > right.getInt());
+    return objectCompareSlow(left, right, COMPARE_GT);
+}
+
+inline MyObject objectLess(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject(left.getInt() < right.getInt());
+    return objectCompareSlow(left, right, COMPARE_LT);
+}
+
+inline MyObject objectGreaterEqual(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject(left.getInt() >= right.getInt());
+    return objectCompareSlow(left, right, COMPARE_GE);
+}
+
+inline MyObject objectLessEqual(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject(left.getInt() <= right.getInt());
+    return objectCompareSlow(left, right, COMPARE_LE);
+}
+
+inline MyObject objectEqual(MyObject left, MyObject right) {
+    if (MyObject::bothInts(left, right))
+        return MyObject(left.getInt() == right.getInt());
+    return objectEqualSlow(left, right);
+}
+
+
+// A string literal from the source, quotes included, with \n, \t, \" and \\ escapes
+MyObject parseStringLiteral(const char *text, size_t length);
+
+
+#endif /* H_OBJECT */
@@ -0,0 +1,361 @@
+#include "optimizer.hpp"
+#include "array.hpp"
+#include "natives.hpp"
+#include <limits>
+#include <sstream>
+
+
+Optimizer::Optimizer(Symbols *symbols) : symbols(symbols) {}
+
+
+void Optimizer::optimize(vector<Statement *> &codes) {
+    int N = codes.size();
+
+    // Rewrite every statement; NULL marks one that does nothing and falls through
+    vector<Statement *> stmts(N);
+    for (int i = 0; i < N; i++) {
+        stmts[i] = codes[i]->optimize(*this);
+    }
+
+    // Only rows reachable from the first one are kept
+    vector<char> reachable(N + 1, 0);
+    vector<int> pending(1, 0);
+    while (!pending.empty()) {
+        int i = pending.back();
+        pending.pop_back();
+        if (i < 0 || i > N || reachable[i])
+            continue;
+        reachable[i] = 1;
+        if (i == N)
+            continue;
+        Branch *branch = dynamic_cast<Branch *>(stmts[i]);
+        if (branch)
+            pending.push_back(i + branch->getSkiprows() + 1);
+        if (!dynamic_cast<Jump *>(stmts[i]) && !dynamic_cast<Return *>(stmts[i]))
+            pending.push_back(i + 1);
+    }
+
+    // A dropped row maps to the next kept one, which is where it would have fallen through to
+    vector<int> index(N + 1);
+    vector<Statement *> kept;
+    for (int i = 0; i < N; i++) {
+        index[i] = kept.size();
+        if (stmts[i] && reachable[i])
+            kept.push_back(stmts[i]);
+    }
+    index[N] = kept.size();
+
+    for (int i = 0; i < N; i++) {
+        Branch *branch = dynamic_cast<Branch *>(stmts[i]);
+        if (branch && reachable[i])
+            branch->setSkiprows(index[i + branch->getSkiprows() + 1] - index[i] - 1);
+    }
+    codes = kept;
+
+    // A while loop is left as an If on top whose false branch lands right after
+    // the Jump back to it. Inner loops come first, being closed first.
+    for (int i = 0; i < (int)codes.size(); i++) {
+        Jump *back = dynamic_cast<Jump *>(codes[i]);
+        int top = back ? i + back->getSkiprows() + 1 : i;
+        If *guard = top < i ? dynamic_cast<If *>(codes[top]) : NULL;
+        if (guard && top + guard->getSkiprows() == i)
+            i = rotate(codes, top, i);
+    }
+}
+
+
+// Puts stmts before row at. Branches keep their targets, so only what comes
+// before them falls through to the new statements.
+static void insert(vector<Statement *> &codes, int at, const vector<Statement *> &stmts) {
+    int n = stmts.size();
+    for (int i = 0; i < (int)codes.size(); i++) {
+        Branch *branch = dynamic_cast<Branch *>(codes[i]);
+        if (!branch)
+            continue;
+        int target = i + branch->getSkiprows() + 1;
+        int from = i < at ? i : i + n, to = target < at ? target : target + n;
+        branch->setSkiprows(to - from - 1);
+    }
+    codes.insert(codes.begin() + at, stmts.begin(), stmts.end());
+}
+
+
+// The If at top skips past the Jump at bottom. Hoisting is exact: the If has
+// just evaluated the same expressions without an error when the body starts,
+// and nothing in the body changes what they read. Returns where the Loop ends up.
+int Optimizer::rotate(vector<Statement *> &codes, int top, int bottom) {
+    If *guard = (If *)codes[top];
+    assigned.clear();
+    for (int i = top + 1; i < bottom; i++) {
+        Assignment *assignment = dynamic_cast<Assignment *>(codes[i]);
+        if (assignment)
+            assigned.insert(assignment->getName());
+    }
+    preheader.clear();
+    Loop *loop = new Loop(guard->getCondition()->hoist(*this, true), top - bottom);
+    loop->setLineno(guard->lineno);
+    codes[bottom] = loop;
+    for (vector<Statement *>::iterator iter = preheader.begin(); iter != preheader.end(); iter++) {
+        (*iter)->setLineno(guard->lineno);
+    }
+    insert(codes, top + 1, preheader);
+    return bottom + preheader.size();
+}
+
+
+bool Optimizer::isAssigned(const string &name) const {
+    return assigned.count(name) > 0;
+}
+
+
+// A variable set to expr before the body, with a name the scanner never makes
+const Expression *Optimizer::hoist(const Expression &expr) {
+    stringstream ss;
+    ss << "(invariant " << symbols->size() << ")";
+    string text = ss.str();
+    const string &name = symbols->name(symbols->intern(text.data(), text.size()));
+    preheader.push_back(new Assignment(name, &expr));
+    return new Variable(name);
+}
+
+
+static const Literal *constant(const Expression &expr) {
+    return dynamic_cast<const Literal *>(&expr);
+}
+
+
+static bool isValue(const Expression &expr, int value) {
+    const Literal *literal = constant(expr);
+    return literal && literal->getValue().isInt() && literal->getValue().getInt() == value;
+}
+
+// Whether the expression can only give a number, or an array of them for which
+// the identities hold element by element: dropping a 0 or a 1 next to a string
+// would turn a concatenation or a type error into the string itself
+static bool isNumber(const Expression &expr) {
+    const Literal *literal = constant(expr);
+    if (literal)
+        return !literal->getValue().isString();
+    return dynamic_cast<const Minus *>(&expr) || dynamic_cast<const Times *>(&expr) || dynamic_cast<const Divide *>(&expr)
+        || dynamic_cast<const GreaterThan *>(&expr) || dynamic_cast<const LessThan *>(&expr)
+        || dynamic_cast<const GreaterEqual *>(&expr) || dynamic_cast<const LessEqual *>(&expr)
+        || dynamic_cast<const Equal *>(&expr);
+}
+
+
+const Expression *Expression::optimize(Optimizer &optimizer) const {
+    return this;
+}
+
+
+const Expression *BinaryOp::optimize(Optimizer &optimizer) const {
+    const Expression *l = left.optimize(optimizer), *r = right.optimize(optimizer);
+    const Literal *a = constant(*l), *b = constant(*r);
+    if (a && b && canFold(a->getValue(), b->getValue()))
+        return new Literal(apply(a->getValue(), b->getValue()));
+    return simplify(*l, *r);
+}
+
+bool Expression::isInvariant(const Optimizer &optimizer) const {
+    return false;
+}
+
+bool Literal::isInvariant(const Optimizer &optimizer) const {
+    return true;
+}
+
+bool Variable::isInvariant(const Optimizer &optimizer) const {
+    return !optimizer.isAssigned(name);
+}
+
+// Calls are never invariant: the function may have an effect, or be defined by the body
+bool BinaryOp::isInvariant(const Optimizer &optimizer) const {
+    return left.isInvariant(optimizer) && right.isInvariant(optimizer);
+}
+
+
+// Only what is certain to have been evaluated is hoisted, and a lone variable or
+// literal is already as cheap as the variable that would replace it
+const Expression *Expression::hoist(Optimizer &optimizer, bool truthy) const {
+    return this;
+}
+
+const Expression *BinaryOp::hoist(Optimizer &optimizer, bool truthy) const {
+    if (isInvariant(optimizer))
+        return optimizer.hoist(*this);
+    const Expression *l = left.hoist(optimizer, false), *r = right.hoist(optimizer, false);
+    return simplify(*l, *r);
+}
+
+const Expression *LogicalAnd::hoist(Optimizer &optimizer, bool truthy) const {
+    if (isInvariant(optimizer))
+        return optimizer.hoist(*this);
+    const Expression *l = left.hoist(optimizer, truthy), *r = truthy ? right.hoist(optimizer, true) : &right;
+    return rebuild<LogicalAnd>(*l, *r);
+}
+
+const Expression *LogicalOr::hoist(Optimizer &optimizer, bool truthy) const {
+    if (isInvariant(optimizer))
+        return optimizer.hoist(*this);
+    return rebuild<LogicalOr>(*left.hoist(optimizer, false), right);
+}
+
+
+// A string operand may raise a type error, and arrays may differ in length,
+// which is left to happen at run time
+bool BinaryOp::canFold(MyObject left, MyObject right) const {
+    return left.isNumber() && right.isNumber();
+}
+
+
+// Identities only drop literal operands: x * 0 keeps x, which may fail or call a function
+
+bool Plus::canFold(MyObject left, MyObject right) const {
+    return !left.isArray() && !right.isArray();
+}
+
+const Expression *Plus::simplify(const Expression &l, const Expression &r) const {
+    if (isValue(r, 0) && isNumber(l))
+        return &l;
+    if (isValue(l, 0) && isNumber(r))
+        return &r;
+    return rebuild<Plus>(l, r);
+}
+
+
+const Expression *Minus::simplify(const Expression &l, const Expression &r) const {
+    if (isValue(r, 0) && isNumber(l))
+        return &l;
+    return rebuild<Minus>(l, r);
+}
+
+
+const Expression *Times::simplify(const Expression &l, const Expression &r) const {
+    if (isValue(r, 1) && isNumber(l))
+        return &l;
+    if (isValue(l, 1) && isNumber(r))
+        return &r;
+    return rebuild<Times>(l, r);
+}
+
+
+// Integer division by zero and the one overflowing quotient are left to fail at run time
+bool Divide::canFold(MyObject left, MyObject right) const {
+    if (!MyObject::bothInts(left, right))
+        return BinaryOp::canFold(left, right);
+    return right.getInt() != 0 && !(right.getInt() == -1 && left.getInt() == numeric_limits<int>::min());
+}
+
+const Expression *Divide::simplify(const Expression &l, const Expression &r) const {
+    if (isValue(r, 1) && isNumber(l))
+        return &l;
+    return rebuild<Divide>(l, r);
+}
+
+
+const Expression *GreaterThan::simplify(const Expression &l, const Expression &r) const {
+    return rebuild<GreaterThan>(l, r);
+}
+
+
+const Expression *LessThan::simplify(const Expression &l, const Expression &r) const {
+    return rebuild<LessThan>(l, r);
+}
+
+
+const Expression *GreaterEqual::simplify(const Expression &l, const Expression &r) const {
+    return rebuild<GreaterEqual>(l, r);
+}
+
+
+const Expression *LessEqual::simplify(const Expression &l, const Expression &r) const {
+    return rebuild<LessEqual>(l, r);
+}
+
+
+bool Equal::canFold(MyObject left, MyObject right) const {
+    return !left.isArray() && !right.isArray();
+}
+
+const Expression *Equal::simplify(const Expression &l, const Expression &r) const {
+    return rebuild<Equal>(l, r);
+}
+
+
+// A constant left side decides whether the right one is evaluated at all
+const Expression *LogicalAnd::simplify(const Expression &l, const Expression &r) const {
+    const Literal *a = constant(l);
+    if (a)
+        return a->getValue().truthy() ? &r : new Literal(false);
+    return rebuild<LogicalAnd>(l, r);
+}
+
+
+const Expression *LogicalOr::simplify(const Expression &l, const Expression &r) const {
+    const Literal *a = constant(l);
+    if (a)
+        return a->getValue().truthy() ? new Literal(true) : &r;
+    return rebuild<LogicalOr>(l, r);
+}
+
+
+// An array literal of numbers only is built once, into the program
+const Expression *Call::optimize(Optimizer &optimizer) const {
+    vector<Expression *> folded;
+    vector<MyObject> values;
+    bool changed = false;
+    for (vector<Expression *>::const_iterator iter = args.begin(); iter != args.end(); iter++) {
+        const Expression *arg = (*iter)->optimize(optimizer);
+        changed = changed || arg != *iter;
+        folded.push_back(const_cast<Expression *>(arg));
+        const Literal *literal = constant(*arg);
+        if (literal && literal->getValue().isNumber())
+            values.push_back(literal->getValue());
+    }
+    if (name == NATIVE_ARRAY && values.size() == folded.size())
+        return new Literal(arrayLiteral(values.data(), values.size()));
+    return changed ? new Call(name, folded) : this;
+}
+
+
+Statement *Statement::optimize(Optimizer &optimizer) {
+    return this;
+}
+
+
+// A constant true condition never jumps, a constant false one always does
+Statement *If::optimize(Optimizer &optimizer) {
+    condition = condition->optimize(optimizer);
+    const Literal *literal = constant(*condition);
+    if (!literal)
+        return this;
+    if (literal->getValue().truthy() || skiprows == 0)
+        return NULL;
+    Jump *jump = new Jump(skiprows);
+    jump->setLineno(lineno);
+    return jump;
+}
+
+
+Statement *Assignment::optimize(Optimizer &optimizer) {
+    expr = expr->optimize(optimizer);
+    return this;
+}
+
+
+Statement *Function::optimize(Optimizer &optimizer) {
+    optimizer.optimize(statements);
+    return this;
+}
+
+
+Statement *Print::optimize(Optimizer &optimizer) {
+    expr = expr->optimize(optimizer);
+    return this;
+}
+
+
+Statement *Return::optimize(Optimizer &optimizer) {
+    expr = expr->optimize(optimizer);
+    return this;
+}
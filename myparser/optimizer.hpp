@@ -0,0 +1,37 @@
+#ifndef H_OPTIMIZER
+#define H_OPTIMIZER
+
+#include <set>
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+#include "symbols.hpp"
+using namespace std;
+
+
+// Folds constant expressions and branches of a parsed program before it runs.
+// Statements that can never execute are dropped and the remaining jumps retargeted.
+//
+// While loops are then rotated: the Jump back to the If on top becomes a Loop
+// that tests the condition itself, so an iteration takes one branch instead of
+// two. The parts of the condition that no statement of the body can change are
+// computed once before the body, into variables named so that no script can
+// refer to them, and the Loop reads those instead.
+class Optimizer {
+private:
+    Symbols *symbols;                   // where the names of those variables go
+    set<string> assigned;               // by the body of the loop being rotated
+    vector<Statement *> preheader;      // assignments to run before its body
+
+    int rotate(vector<Statement *> &codes, int top, int bottom);
+
+public:
+    Optimizer(Symbols *symbols);
+
+    void optimize(vector<Statement *> &codes);
+    bool isAssigned(const string &name) const;
+    const Expression *hoist(const Expression &expr);
+};
+
+
+#endif /* H_OPTIMIZER */
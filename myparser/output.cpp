@@ -0,0 +1,106 @@
+#include "output.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+OutputBuffer::OutputBuffer(int fd, bool owned, bool threaded)
+    : fd(fd), owned(owned), current(0), failed(false), pending(0), stopping(false) {
+    buffers[0].resize(OUTPUT_BUFFER_SIZE);
+    if (threaded) {
+        buffers[1].resize(OUTPUT_BUFFER_SIZE);
+        writer = thread(&OutputBuffer::writeLoop, this);
+    }
+    setp(buffers[0].data(), buffers[0].data() + buffers[0].size());
+}
+
+OutputBuffer::~OutputBuffer() {
+    sync();
+    if (writer.joinable()) {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        writer.join();
+    }
+    if (owned)
+        close(fd);
+}
+
+OutputBuffer *OutputBuffer::open(const string &path, bool threaded) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return fd < 0 ? NULL : new OutputBuffer(fd, true, threaded);
+}
+
+
+void OutputBuffer::writeAll(const char *data, size_t size) {
+    while (size > 0 && !failed) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            failed = true;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+// Writes out what the current buffer holds, or with the thread hands it over
+// and goes on with the other one
+void OutputBuffer::handOff() {
+    size_t size = pptr() - pbase();
+    if (!writer.joinable()) {
+        writeAll(pbase(), size);
+    } else if (size > 0) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() { return pending == 0; });
+        pending = size;
+        current = 1 - current;
+        guard.unlock();
+        changed.notify_all();
+    }
+    setp(buffers[current].data(), buffers[current].data() + buffers[current].size());
+}
+
+// The buffer being written is always the one not being filled, which cannot
+// change while pending is set
+void OutputBuffer::writeLoop() {
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        changed.wait(guard, [this]() { return pending > 0 || stopping; });
+        if (pending == 0)
+            return;
+        const char *data = buffers[1 - current].data();
+        size_t size = pending;
+        guard.unlock();
+        writeAll(data, size);
+        guard.lock();
+        pending = 0;
+        changed.notify_all();
+    }
+}
+
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c) {
+    handOff();
+    if (failed)
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+// Returns once everything so far has been written
+int OutputBuffer::sync() {
+    handOff();
+    if (writer.joinable()) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() { return pending == 0; });
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+#ifndef H_OUTPUT
+#define H_OUTPUT
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+
+
+// Bytes gathered before a write to the file descriptor; with a writer thread
+// there are two buffers of this size
+#define OUTPUT_BUFFER_SIZE (1 << 18)
+
+
+// What the scripts print, written to a file descriptor only when the buffer
+// fills up, on flush() and when it is destroyed. print ends its lines with
+// '\n' rather than endl, so a line costs a copy and not a system call.
+//
+// With a writer thread the buffers take turns: the interpreter fills one while
+// the thread writes the other out, and waits only if the thread is still busy
+// with the previous one when the next fills up.
+class OutputBuffer : public streambuf {
+private:
+    int fd;
+    bool owned;                         // opened by open(), closed with the buffer
+    vector<char> buffers[2];
+    int current;                        // the one being filled
+    atomic<bool> failed;                // a write failed; what follows is dropped
+
+    thread writer;
+    mutex lock;
+    condition_variable changed;
+    size_t pending;                     // bytes of the other buffer the thread has yet to write
+    bool stopping;
+
+    void writeAll(const char *data, size_t size);
+    void handOff();
+    void writeLoop();
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+public:
+    OutputBuffer(int fd, bool owned, bool threaded);
+    ~OutputBuffer();
+
+    // Creates or truncates path, NULL if it cannot be opened
+    static OutputBuffer *open(const string &path, bool threaded);
+};
+
+
+#endif /* H_OUTPUT */
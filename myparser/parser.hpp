@@ -0,0 +1,48 @@
+#ifndef H_PARSER
+#define H_PARSER
+
+#include <string>
+#include <vector>
+#include "arena.hpp"
+#include "symbols.hpp"
+using namespace std;
+
+
+class Statement;
+
+
+// A parsed script that has not run yet: its top-level statements in order
+struct Program {
+    vector<Statement *> statements;
+    Symbols symbols;                    // the names its nodes refer to
+    Arena arena;                        // its nodes, freed along with it
+};
+
+
+// A script mapped copy-on-write, followed by the two NUL bytes the scanner
+// needs to work on it in place instead of on a copy
+class SourceFile {
+private:
+    char *data;
+    size_t size;
+    size_t mapped;
+
+public:
+    SourceFile(const string &path);     // throws a StringException if it can't be read
+    ~SourceFile();
+    char *getData() const;
+    size_t getSize() const;
+};
+
+
+// Parse a whole script into a Program without running it. Every call has a
+// scanner and parser of its own, so scripts may be parsed on several threads
+// at once. Syntax errors and unreadable files throw a StringException.
+// parseBuffer scans the buffer in place: buffer[size] and buffer[size + 1]
+// must be NUL, and the contents are undefined afterwards.
+Program *parseFile(const string &path);
+Program *parseSource(const string &source);
+Program *parseBuffer(char *buffer, size_t size);
+
+
+#endif /* H_PARSER */
@@ -0,0 +1,132 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+
+Profiler::Profiler(const string &path) : path(path), statements(0), maxDepth(0) {
+    Node root = {-1, 0, "", map<string, int>(), 0};
+    nodes.push_back(root);
+}
+
+
+void Profiler::statement(int lineno) {
+    statements++;
+    if (lineno >= (int)lines.size())
+        lines.resize(lineno + 1, 0);
+    lines[lineno]++;
+}
+
+
+void Profiler::enter(const string &name) {
+    int parent = stack.empty() ? 0 : stack.back().node;
+    int node = parent;
+    if (nodes[parent].name != name && nodes[parent].depth < PROFILE_MAX_STACK) {
+        auto child = nodes[parent].children.find(name);
+        if (child != nodes[parent].children.end()) {
+            node = child->second;
+        } else {
+            node = nodes.size();
+            nodes[parent].children[name] = node;
+            Node created = {parent, nodes[parent].depth + 1, name, map<string, int>(), 0};
+            nodes.push_back(created);
+        }
+    }
+
+    Function &function = functions[name];
+    function.calls++;
+    function.active++;
+    function.maxActive = max(function.maxActive, function.active);
+
+    Activation activation = {node, &function, Clock::now(), 0};
+    stack.push_back(activation);
+    maxDepth = max(maxDepth, stack.size());
+}
+
+
+void Profiler::leave() {
+    Activation activation = stack.back();
+    stack.pop_back();
+    double elapsed = chrono::duration<double>(Clock::now() - activation.start).count();
+    Function &function = *activation.function;
+    // Recursive activations are already inside the outermost one's inclusive time
+    if (--function.active == 0)
+        function.inclusive += elapsed;
+    function.exclusive += elapsed - activation.children;
+    nodes[activation.node].exclusive += elapsed - activation.children;
+    if (!stack.empty())
+        stack.back().children += elapsed;
+}
+
+
+// Closes whatever is still running: main, or every frame when the script failed
+void Profiler::finish() {
+    while (!stack.empty()) {
+        leave();
+    }
+}
+
+
+static bool byExclusive(const pair<string, double> &a, const pair<string, double> &b) {
+    return a.second > b.second;
+}
+
+static bool byCount(const pair<int, unsigned long> &a, const pair<int, unsigned long> &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+}
+
+
+void Profiler::report(ostream &out) {
+    finish();
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+    out << "profile: " << statements << " statements, max depth " << maxDepth << ", call stacks in " << path << endl;
+
+    vector<pair<string, double> > order;
+    for (map<string, Function>::iterator iter = functions.begin(); iter != functions.end(); iter++) {
+        order.push_back(make_pair(iter->first, iter->second.exclusive));
+    }
+    stable_sort(order.begin(), order.end(), byExclusive);
+    out << left << setw(20) << "function" << right << setw(12) << "calls" << setw(16) << "inclusive ms"
+        << setw(16) << "exclusive ms" << setw(12) << "max depth" << endl;
+    out << fixed << setprecision(3);
+    for (vector<pair<string, double> >::iterator iter = order.begin(); iter != order.end(); iter++) {
+        const Function &function = functions[iter->first];
+        out << left << setw(20) << iter->first << right << setw(12) << function.calls
+            << setw(16) << function.inclusive * 1000 << setw(16) << function.exclusive * 1000
+            << setw(12) << function.maxActive << endl;
+    }
+
+    vector<pair<int, unsigned long> > counts;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (lines[i])
+            counts.push_back(make_pair((int)i, lines[i]));
+    }
+    sort(counts.begin(), counts.end(), byCount);
+    out << left << setw(20) << "line" << right << setw(12) << "executions" << endl;
+    for (vector<pair<int, unsigned long> >::iterator iter = counts.begin(); iter != counts.end(); iter++) {
+        out << left << setw(20) << iter->first << right << setw(12) << iter->second << endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+
+    ofstream file(path.c_str());
+    if (!file) {
+        out << "Can't write " << path << endl;
+        return;
+    }
+    for (map<string, int>::const_iterator iter = nodes[0].children.begin(); iter != nodes[0].children.end(); iter++) {
+        folded(file, iter->second, "");
+    }
+}
+
+
+void Profiler::folded(ostream &out, int node, const string &prefix) const {
+    string stack = prefix + nodes[node].name;
+    long micros = (long)(nodes[node].exclusive * 1e6 + 0.5);
+    if (micros > 0)
+        out << stack << " " << micros << endl;
+    for (map<string, int>::const_iterator iter = nodes[node].children.begin(); iter != nodes[node].children.end(); iter++) {
+        folded(out, iter->second, stack + ";");
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef H_PROFILER
+#define H_PROFILER
+
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+
+// Default file the folded call stacks are written to, one line per stack
+// with its exclusive time in microseconds, as flamegraph.pl reads them
+#define DEFAULT_PROFILE_PATH "profile.folded"
+
+// Call stacks are cut at this many frames; deeper calls count towards the last one kept.
+// Direct recursion is folded into a single frame.
+#define PROFILE_MAX_STACK 256
+
+
+// Fed by the statement walker while --profile is on: statements executed per
+// source line, and calls, inclusive and exclusive time per function, kept
+// both per function and per distinct call stack.
+class Profiler {
+private:
+    typedef chrono::steady_clock Clock;
+
+    struct Function {
+        unsigned long calls;
+        double inclusive, exclusive;        // seconds
+        int active;                         // activations on the stack right now
+        int maxActive;                      // deepest recursion seen
+    };
+
+    struct Node {                           // one distinct call stack
+        int parent;
+        int depth;
+        string name;
+        map<string, int> children;
+        double exclusive;
+    };
+
+    struct Activation {
+        int node;
+        Function *function;
+        Clock::time_point start;
+        double children;                    // time spent in its callees
+    };
+
+    const string path;
+    vector<unsigned long> lines;            // executions by source line
+    map<string, Function> functions;
+    vector<Node> nodes;                     // nodes[0] is the root above main
+    vector<Activation> stack;
+    unsigned long statements;
+    size_t maxDepth;
+
+    void folded(ostream &out, int node, const string &prefix) const;
+
+public:
+    Profiler(const string &path);
+
+    void statement(int lineno);
+    void enter(const string &name);
+    void leave();
+    void finish();
+    void report(ostream &out);
+};
+
+
+#endif /* H_PROFILER */
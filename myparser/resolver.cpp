@@ -0,0 +1,197 @@
+#include "resolver.hpp"
+#include "natives.hpp"
+
+
+Resolver::Resolver(bool tailCalls)
+    : tailCalls(tailCalls), effects(false), root(this), natives(NULL), directNatives(false), statements(0) {}
+
+
+void Resolver::setNatives(const Natives *natives, bool direct) {
+    this->natives = natives;
+    this->directNatives = direct;
+}
+
+
+int Resolver::resolve(const vector<string> &params, const vector<Statement *> &codes) {
+    for (vector<string>::const_iterator iter = params.begin(); iter != params.end(); iter++) {
+        slot(*iter);
+    }
+    if (root == this)
+        define(codes);
+    root->statements += codes.size();
+    for (vector<Statement *>::const_iterator iter = codes.begin(); iter != codes.end(); iter++) {
+        (*iter)->resolve(*this);
+    }
+    return slots.size();
+}
+
+
+// A call may come before the definition it finds at run time, so all of them are known up front
+void Resolver::define(const vector<Statement *> &codes) {
+    for (vector<Statement *>::const_iterator iter = codes.begin(); iter != codes.end(); iter++) {
+        Function *function = dynamic_cast<Function *>(*iter);
+        if (function) {
+            definitions.insert(function->getName());
+            define(function->getStatements());
+        }
+    }
+}
+
+
+int Resolver::slot(const string &name) {
+    auto iter = slots.find(name);
+    if (iter != slots.end())
+        return iter->second;
+    int slot = slots.size();
+    slots[name] = slot;
+    return slot;
+}
+
+
+int Resolver::function(Function *function, const string &name, const vector<string> &params, const vector<Statement *> &codes) {
+    Resolver resolver(tailCalls);
+    resolver.root = root;
+    int nslots = resolver.resolve(params, codes);
+    Summary summary = {function, name, resolver.calls, resolver.effects};
+    root->summaries.push_back(summary);
+
+    // Defining a function changes what every later call finds
+    effect();
+    return nslots;
+}
+
+
+// The native the call binds to, or NULL. A script function of the same name
+// takes precedence. A native with effects makes its caller impure.
+const NativeFunction *Resolver::call(const string &name) {
+    const NativeFunction *native = NULL;
+    if (root->natives && !root->definitions.count(name))
+        native = root->natives->find(name);
+    if (!native)
+        calls.insert(name);
+    else if (!native->pure)
+        effect();
+    return native;
+}
+
+
+void Resolver::effect() {
+    effects = true;
+}
+
+
+// Functions cannot see globals, so a function is pure unless it prints, defines
+// a function, or calls one that is not pure itself. A name defined more than
+// once is bound at run time to whichever definition runs first, so calling it
+// is never taken as pure. Calls bound to natives are not among the calls.
+void Resolver::findPure() {
+    map<string, int> definitions;
+    for (vector<Summary>::iterator iter = summaries.begin(); iter != summaries.end(); iter++) {
+        definitions[iter->name]++;
+    }
+    map<string, bool> pure;
+    for (vector<Summary>::iterator iter = summaries.begin(); iter != summaries.end(); iter++) {
+        if (definitions[iter->name] == 1)
+            pure[iter->name] = !iter->effects;
+    }
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (vector<Summary>::iterator iter = summaries.begin(); iter != summaries.end(); iter++) {
+            if (!pure[iter->name])
+                continue;
+            for (set<string>::iterator callee = iter->calls.begin(); callee != iter->calls.end(); callee++) {
+                if (!pure[*callee]) {
+                    pure[iter->name] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+    for (vector<Summary>::iterator iter = summaries.begin(); iter != summaries.end(); iter++) {
+        iter->function->setPure(pure[iter->name]);
+    }
+}
+
+
+bool Resolver::getTailCalls() const {
+    return tailCalls;
+}
+
+
+bool Resolver::getDirectNatives() const {
+    return root->directNatives;
+}
+
+
+int Resolver::getStatements() const {
+    return statements;
+}
+
+
+void BinaryOp::resolve(Resolver &resolver) const {
+    left.resolve(resolver);
+    right.resolve(resolver);
+    hasCall = left.hasCall || right.hasCall;
+}
+
+
+void Literal::resolve(Resolver &resolver) const {
+}
+
+
+void Variable::resolve(Resolver &resolver) const {
+    slot = resolver.slot(name);
+}
+
+
+// A native is called in place when its arguments make no calls either
+void Call::resolve(Resolver &resolver) const {
+    bool argsCall = false;
+    for (vector<Expression *>::const_iterator iter = args.begin(); iter != args.end(); iter++) {
+        (*iter)->resolve(resolver);
+        argsCall = argsCall || (*iter)->hasCall;
+    }
+    native = resolver.call(name);
+    hasCall = !native || !resolver.getDirectNatives() || argsCall;
+}
+
+
+void If::resolve(Resolver &resolver) {
+    condition->resolve(resolver);
+}
+
+
+void Jump::resolve(Resolver &resolver) {
+}
+
+
+void Loop::resolve(Resolver &resolver) {
+    condition->resolve(resolver);
+}
+
+
+void Assignment::resolve(Resolver &resolver) {
+    expr->resolve(resolver);
+    slot = resolver.slot(name);
+}
+
+
+void Function::resolve(Resolver &resolver) {
+    nslots = resolver.function(this, name, arguments, statements);
+}
+
+
+void Print::resolve(Resolver &resolver) {
+    resolver.effect();
+    expr->resolve(resolver);
+}
+
+
+void Return::resolve(Resolver &resolver) {
+    expr->resolve(resolver);
+    const Call *call = dynamic_cast<const Call *>(expr);
+    // A native has no frame to replace
+    if (call)
+        call->setTail(resolver.getTailCalls() && !call->getNative());
+}
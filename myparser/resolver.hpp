@@ -0,0 +1,55 @@
+#ifndef H_RESOLVER
+#define H_RESOLVER
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "interpreter.hpp"
+using namespace std;
+
+
+// Gives every variable of a function scope a fixed slot in its frame.
+// Parameters take the first slots, in order.
+// Along the way it notes what every function calls and whether it has side effects,
+// from which findPure() marks the functions whose result depends on their arguments only.
+// Calls to a name no script function has are bound to the native of that name, if any,
+// as they are resolved: the root collects every function name before it starts.
+class Resolver {
+private:
+    struct Summary {
+        Function *function;
+        string name;
+        set<string> calls;
+        bool effects;
+    };
+
+    map<string, int> slots;
+    bool tailCalls;                     // mark calls whose value is returned right away
+    set<string> calls;                  // functions called from this scope
+    bool effects;                       // prints or defines a function
+    Resolver *root;                     // resolver of the main program, which collects the summaries
+    vector<Summary> summaries;
+    set<string> definitions;            // every function name in the program, kept by the root
+    const Natives *natives;             // NULL binds no call to a native
+    bool directNatives;                 // natives may be called in place by the statement walker
+    int statements;                     // in the program and every function body, counted by the root
+
+    void define(const vector<Statement *> &codes);
+
+public:
+    Resolver(bool tailCalls);
+    void setNatives(const Natives *natives, bool direct);
+    int resolve(const vector<string> &params, const vector<Statement *> &codes);
+    int slot(const string &name);
+    int function(Function *function, const string &name, const vector<string> &params, const vector<Statement *> &codes);
+    const NativeFunction *call(const string &name);
+    void effect();
+    void findPure();
+    bool getTailCalls() const;
+    bool getDirectNatives() const;
+    int getStatements() const;
+};
+
+
+#endif /* H_RESOLVER */
@@ -0,0 +1,34 @@
+#include "stats.hpp"
+
+
+Stats::Stats() : engine(""), statements(0), suspended(0), calls(0), cacheMisses(0), frames(0), maxDepth(0),
+    variableLookups(0), frameBytes(0), astBytes(0) {}
+
+
+// Every call goes through a call site, so the ones that did not look their function up hit the cache
+void Stats::report(ostream &out, StatsFormat format) const {
+    // A lookup of a function that does not exist is a miss but never becomes a call
+    unsigned long cacheHits = calls > cacheMisses ? calls - cacheMisses : 0;
+    if (format == STATS_JSON) {
+        out << "{\"engine\": \"" << engine << "\""
+            << ", \"statements\": " << statements
+            << ", \"suspended_statements\": " << suspended
+            << ", \"calls\": " << calls
+            << ", \"call_cache_hits\": " << cacheHits
+            << ", \"call_cache_misses\": " << cacheMisses
+            << ", \"frames_pushed\": " << frames
+            << ", \"max_depth\": " << maxDepth
+            << ", \"variable_lookups\": " << variableLookups
+            << ", \"function_lookups\": " << cacheMisses
+            << ", \"frame_bytes\": " << frameBytes
+            << ", \"ast_bytes\": " << astBytes << "}" << endl;
+    } else if (format == STATS_TEXT) {
+        out << "stats (" << engine << " engine)" << endl
+            << "  statements: " << statements << " executed, " << suspended << " suspended on a call" << endl
+            << "  calls: " << calls << ", call cache " << cacheHits << " hits, " << cacheMisses << " misses" << endl
+            << "  frames: " << frames << " pushed, max depth " << maxDepth << endl
+            << "  lookups: " << variableLookups << " variables, " << cacheMisses << " functions" << endl
+            << "  bytes: " << frameBytes << " for frames, " << astBytes << " for the syntax tree" << endl;
+    }
+}
+
@@ -0,0 +1,45 @@
+#ifndef H_STATS
+#define H_STATS
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+using namespace std;
+
+
+enum StatsFormat {
+    STATS_NONE,
+    STATS_TEXT,             // --stats, a few lines on stderr
+    STATS_JSON,             // --stats=json, one JSON object on stderr
+};
+
+
+// Counters kept by every engine whether or not --stats asks for them, each a
+// single increment where it happens. An engine leaves the ones it has no
+// equivalent for at 0: only the tree engine suspends statements and looks
+// variables up by slot, the VM runs instructions rather than statements and
+// closure frames live on the native stack.
+class Stats {
+public:
+    const char *engine;
+    unsigned long statements;           // executed
+    unsigned long suspended;            // left waiting for a call to return, to be resumed later
+    unsigned long calls;                // including memoized ones and those made by compiled code
+    unsigned long cacheMisses;          // call sites that had to look their function up by name
+    unsigned long frames;               // pushed
+    unsigned long maxDepth;
+    unsigned long variableLookups;
+    size_t frameBytes;                  // reserved for frames and their variables, at its largest
+    size_t astBytes;                    // syntax tree nodes of the program, the optimizer's included
+
+    Stats();
+
+    void depth(size_t depth) {
+        if (depth > maxDepth)
+            maxDepth = depth;
+    }
+    void report(ostream &out, StatsFormat format) const;
+};
+
+
+#endif /* H_STATS */
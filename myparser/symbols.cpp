@@ -0,0 +1,52 @@
+#include "symbols.hpp"
+#include <cstring>
+
+
+Symbols::Symbols() : table(64, 0) {}
+
+
+// FNV-1a
+size_t Symbols::hash(const char *text, size_t length) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+int Symbols::intern(const char *text, size_t length) {
+    size_t mask = table.size() - 1;
+    for (size_t i = hash(text, length) & mask;; i = (i + 1) & mask) {
+        int id = table[i] - 1;
+        if (id < 0) {
+            id = names.size();
+            names.push_back(string(text, length));
+            table[i] = id + 1;
+            // Kept at most half full
+            if (names.size() * 2 > table.size())
+                grow();
+            return id;
+        }
+        const string &name = names[id];
+        if (name.size() == length && memcmp(name.data(), text, length) == 0)
+            return id;
+    }
+}
+
+
+void Symbols::grow() {
+    table.assign(table.size() * 2, 0);
+    size_t mask = table.size() - 1;
+    for (size_t id = 0; id < names.size(); id++) {
+        size_t i = hash(names[id].data(), names[id].size()) & mask;
+        while (table[i])
+            i = (i + 1) & mask;
+        table[i] = id + 1;
+    }
+}
+
+
+int Symbols::size() const {
+    return names.size();
+}
@@ -0,0 +1,33 @@
+#ifndef H_SYMBOLS
+#define H_SYMBOLS
+
+#include <deque>
+#include <string>
+#include <vector>
+using namespace std;
+
+
+// The identifiers of one program, each stored once and numbered in order of
+// appearance. They are looked up by their characters where they lie in the
+// source, so a name seen before costs no allocation. The strings never move
+// once interned: syntax nodes keep references to them.
+class Symbols {
+private:
+    deque<string> names;
+    vector<int> table;                  // open addressing on the characters, id + 1 or 0 if free
+
+    static size_t hash(const char *text, size_t length);
+    void grow();
+
+public:
+    Symbols();
+
+    int intern(const char *text, size_t length);
+    const string &name(int id) const {
+        return names[id];
+    }
+    int size() const;
+};
+
+
+#endif /* H_SYMBOLS */
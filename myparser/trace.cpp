@@ -0,0 +1,71 @@
+#include "trace.hpp"
+#include <iostream>
+
+
+Tracer::Tracer() : kinds(0), out(&cerr), ringSize(0) {}
+
+Tracer::~Tracer() {
+    flush();
+}
+
+
+// Comma separated kinds: stmt, call, code or all
+bool Tracer::setKinds(const string &list) {
+    unsigned parsed = 0;
+    stringstream ss(list);
+    string kind;
+    while (getline(ss, kind, ',')) {
+        if (kind == "stmt")
+            parsed |= TRACE_STMT;
+        else if (kind == "call")
+            parsed |= TRACE_CALL;
+        else if (kind == "code")
+            parsed |= TRACE_CODE;
+        else if (kind == "all")
+            parsed |= TRACE_STMT | TRACE_CALL | TRACE_CODE;
+        else
+            return false;
+    }
+    kinds = parsed;
+    return true;
+}
+
+void Tracer::setStream(ostream *out) {
+    this->out = out;
+}
+
+bool Tracer::setFile(const string &path) {
+    file.open(path.c_str());
+    if (!file)
+        return false;
+    out = &file;
+    return true;
+}
+
+void Tracer::setRing(size_t size) {
+    ringSize = size;
+}
+
+
+ostream &Tracer::begin() {
+    event.str("");
+    return event;
+}
+
+void Tracer::end() {
+    if (ringSize == 0) {
+        *out << event.str() << '\n';
+        return;
+    }
+    if (ring.size() == ringSize)
+        ring.pop_front();
+    ring.push_back(event.str());
+}
+
+void Tracer::flush() {
+    for (deque<string>::iterator iter = ring.begin(); iter != ring.end(); iter++) {
+        *out << *iter << '\n';
+    }
+    ring.clear();
+    out->flush();
+}
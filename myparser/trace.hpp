@@ -0,0 +1,77 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <deque>
+#include <fstream>
+#include <ostream>
+#include <sstream>
+#include <string>
+using namespace std;
+
+
+// What --trace can record
+enum TraceKind {
+    TRACE_STMT = 1,         // every statement the tree engine executes
+    TRACE_CALL = 2,         // calls with their arguments, and returns
+    TRACE_CODE = 4,         // bytecode compiled for the VM
+};
+
+
+// Writes the events of the enabled kinds to stderr or a file, or keeps the
+// last ones in a ring buffer written out when the tracer is destroyed, which
+// includes exiting on an error.
+class Tracer {
+private:
+    unsigned kinds;
+    ofstream file;
+    ostream *out;
+    deque<string> ring;
+    size_t ringSize;                // 0 writes every event as it happens
+    stringstream event;
+
+public:
+    Tracer();
+    ~Tracer();
+
+    bool enabled(unsigned kind) const {
+        return (kinds & kind) != 0;
+    }
+    bool setKinds(const string &list);
+    void setStream(ostream *out);
+    bool setFile(const string &path);
+    void setRing(size_t size);
+
+    ostream &begin();
+    void end();
+    void flush();
+};
+
+
+// Builds the event only when its kind is enabled; compiled out entirely with -DNO_TRACE
+#ifdef NO_TRACE
+#define TRACE(tracer, kind, message)
+#else
+#define TRACE(tracer, kind, message) \
+    do { \
+        if ((tracer).enabled(kind)) { \
+            (tracer).begin() << message; \
+            (tracer).end(); \
+        } \
+    } while (0)
+#endif
+
+
+// "(1, 2)", the arguments of a call event
+template <class T>
+string traceArgs(const T *args, int nargs) {
+    stringstream ss;
+    ss << "(";
+    for (int i = 0; i < nargs; i++) {
+        ss << (i ? ", " : "") << args[i];
+    }
+    ss << ")";
+    return ss.str();
+}
+
+
+#endif /* H_TRACE */
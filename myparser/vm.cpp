@@ -0,0 +1,261 @@
+#include "vm.hpp"
+#include "memo.hpp"
+#include "natives.hpp"
+#include "jit.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <climits>
+#include <sstream>
+
+
+// Threaded dispatch through a label table where the compiler supports it, a switch otherwise
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_LABEL(name, a, b, c) &&L_##name,
+#define VM_DISPATCH() goto *labels[pc->op];
+#define VM_CASE(name) L_##name:
+#define VM_NEXT() goto *labels[pc->op]
+#else
+#define VM_DISPATCH() for (;;) switch (pc->op)
+#define VM_CASE(name) case OP_##name:
+#define VM_NEXT() continue
+#endif
+
+
+VM::VM(Module *module, int maxDepth, size_t memoSize, bool jit, bool jitDump, Tracer *tracer, Stats *stats, ostream *out)
+    : module(module), bindings(module->names.size(), -1), maxDepth(maxDepth), jit(NULL), jitFloor(INT_MAX), tracer(tracer), stats(stats), out(out) {
+    for (vector<FunctionCode *>::iterator iter = module->functions.begin(); iter != module->functions.end(); iter++) {
+        if ((*iter)->pure && memoSize > 0 && (*iter)->memo == NULL)
+            (*iter)->memo = new MemoTable((*iter)->name, (*iter)->nparams, memoSize);
+    }
+    // Calls made inside compiled code could not be traced
+    if (jit && JIT::available() && !tracer->enabled(TRACE_CALL))
+        this->jit = new JIT(module, &bindings, jitDump, stats);
+}
+
+VM::~VM() {
+    delete jit;
+}
+
+
+// Function bound at a CALL or TCALL site, checked against the number of arguments passed
+int VM::link(const Instruction *pc) const {
+    stats->cacheMisses++;
+    int index = bindings[pc->b];
+    if (index < 0)
+        throw StringException("Cannot find function " + module->names[pc->b]);
+    if (module->functions[index]->nparams != pc->c) {
+        stringstream ss;
+        ss << "Function " << module->names[pc->b] << " takes " << module->functions[index]->nparams << " arguments, " << pc->c << " given";
+        throw StringException(ss.str());
+    }
+    return index;
+}
+
+
+// False when the script stopped on an error, printed to out
+bool VM::run() {
+#ifdef VM_COMPUTED_GOTO
+    static const void *labels[OP_COUNT] = { OPCODES(VM_LABEL) };
+#endif
+
+    FunctionCode *function = module->functions[0];
+    Instruction *code = &function->code[0];
+    Instruction *pc = code;
+    size_t base = 0;
+    stack.assign(max(function->nregs, 1024), 0);
+    MyObject *R = stack.data();
+    stats->frames++;
+    stats->depth(1);
+    stats->frameBytes = stack.capacity() * sizeof(MyObject);
+
+    try {
+        VM_DISPATCH() {
+        VM_CASE(NOP)
+            ++pc;
+            VM_NEXT();
+        VM_CASE(MOVE)
+            R[pc->a] = R[pc->b];
+            ++pc;
+            VM_NEXT();
+        VM_CASE(LOADI)
+            R[pc->a] = pc->b;
+            ++pc;
+            VM_NEXT();
+        VM_CASE(LOADK)
+            R[pc->a] = function->constants[pc->b];
+            ++pc;
+            VM_NEXT();
+
+#define VM_BINARY(name, fn) \
+        VM_CASE(name) \
+            R[pc->a] = fn(R[pc->b], R[pc->c]); \
+            ++pc; \
+            VM_NEXT(); \
+        VM_CASE(name##I) \
+            R[pc->a] = fn(R[pc->b], MyObject(pc->c)); \
+            ++pc; \
+            VM_NEXT();
+
+        VM_BINARY(ADD, objectAdd)
+        VM_BINARY(SUB, objectSubtract)
+        VM_BINARY(MUL, objectMultiply)
+        VM_BINARY(DIV, objectDivide)
+        VM_BINARY(GT, objectGreater)
+        VM_BINARY(LT, objectLess)
+        VM_BINARY(GE, objectGreaterEqual)
+        VM_BINARY(LE, objectLessEqual)
+        VM_BINARY(EQ, objectEqual)
+#undef VM_BINARY
+
+        VM_CASE(JMP)
+            pc = code + pc->b;
+            VM_NEXT();
+        VM_CASE(JMPF)
+            pc = R[pc->a].truthy() ? pc + 1 : code + pc->b;
+            VM_NEXT();
+        VM_CASE(JMPT)
+            pc = R[pc->a].truthy() ? code + pc->b : pc + 1;
+            VM_NEXT();
+
+#define VM_COMPARE_JUMP(name, fn) \
+        VM_CASE(J##name) \
+            pc = fn(R[pc->a], R[pc->c]).truthy() ? code + pc->b : pc + 1; \
+            VM_NEXT(); \
+        VM_CASE(J##name##I) \
+            pc = fn(R[pc->a], MyObject(pc->c)).truthy() ? code + pc->b : pc + 1; \
+            VM_NEXT();
+
+        VM_COMPARE_JUMP(GT, objectGreater)
+        VM_COMPARE_JUMP(LT, objectLess)
+        VM_COMPARE_JUMP(GE, objectGreaterEqual)
+        VM_COMPARE_JUMP(LE, objectLessEqual)
+        VM_COMPARE_JUMP(EQ, objectEqual)
+#undef VM_COMPARE_JUMP
+
+        VM_CASE(CHKDEF)
+            if (!R[pc->a].truthy())
+                throw StringException("Variable not found: " + module->names[pc->b]);
+            ++pc;
+            VM_NEXT();
+        VM_CASE(CALL)
+            // Resolve and check the call site once, then rewrite it into a CALLF
+            pc->b = link(pc);
+            pc->op = OP_CALLF;
+            // fall through
+        VM_CASE(CALLF) {
+            FunctionCode *callee = module->functions[pc->b];
+            stats->calls++;
+            TRACE(*tracer, TRACE_CALL, "call " << callee->name << traceArgs(R + pc->a, pc->c));
+            if (callee->memo) {
+                if (callee->memo->lookup(R + pc->a, R + pc->a)) {
+                    TRACE(*tracer, TRACE_CALL, "return " << R[pc->a] << " (memo)");
+                    ++pc;
+                    VM_NEXT();
+                }
+                memoArgs.insert(memoArgs.end(), R + pc->a, R + pc->a + pc->c);
+            }
+            if ((int)frames.size() >= maxDepth) {
+                stringstream ss;
+                ss << "Stack overflow: more than " << maxDepth << " nested calls";
+                throw StringException(ss.str());
+            }
+            if (callee->native && (int)frames.size() < jitFloor) {
+                MyObject value;
+                if (jit->call(callee, R + pc->a, maxDepth - frames.size(), &value)) {
+                    R[pc->a] = value;
+                    ++pc;
+                    VM_NEXT();
+                }
+                // Out of native stack, or an error the VM reports: run this call and all it makes here
+                jitFloor = frames.size();
+            } else if (jit && callee->calls < JIT_THRESHOLD && ++callee->calls == JIT_THRESHOLD) {
+                jit->compile(callee);
+            }
+            Frame frame = {function, pc, base};
+            frames.push_back(frame);
+            stats->frames++;
+            stats->depth(frames.size() + 1);
+            base += pc->a;
+            if (base + callee->nregs > stack.size()) {
+                stack.resize(max(base + callee->nregs, stack.size() * 2));
+                stats->frameBytes = stack.capacity() * sizeof(MyObject) + frames.capacity() * sizeof(Frame);
+            }
+            R = stack.data() + base;
+            fill(R + pc->c, R + callee->nregs, 0);
+            function = callee;
+            code = &function->code[0];
+            pc = code;
+            VM_NEXT();
+        }
+        VM_CASE(TCALL)
+            pc->b = link(pc);
+            // Memoized calls keep their frame to store the result on return
+            pc->op = frames.empty() || function->memo || module->functions[pc->b]->memo ? OP_CALLF : OP_TCALLF;
+            VM_NEXT();
+        VM_CASE(TCALLF) {
+            // The callee takes over the current window, arguments moved down to its start
+            FunctionCode *callee = module->functions[pc->b];
+            stats->calls++;
+            TRACE(*tracer, TRACE_CALL, "tail call " << callee->name << traceArgs(R + pc->a, pc->c));
+            copy(R + pc->a, R + pc->a + pc->c, R);
+            if (base + callee->nregs > stack.size()) {
+                stack.resize(max(base + callee->nregs, stack.size() * 2));
+                stats->frameBytes = stack.capacity() * sizeof(MyObject) + frames.capacity() * sizeof(Frame);
+                R = stack.data() + base;
+            }
+            fill(R + pc->c, R + callee->nregs, 0);
+            function = callee;
+            code = &function->code[0];
+            pc = code;
+            VM_NEXT();
+        }
+        VM_CASE(NATIVE) {
+            const NativeFunction *native = module->natives[pc->b];
+            stats->calls++;
+            TRACE(*tracer, TRACE_CALL, "call " << native->name << traceArgs(R + pc->a, pc->c));
+            R[pc->a] = callNative(native, R + pc->a, pc->c);
+            ++pc;
+            VM_NEXT();
+        }
+        VM_CASE(RET) {
+            MyObject value = R[pc->a];
+            if (frames.empty())
+                return true;
+            TRACE(*tracer, TRACE_CALL, "return " << value);
+            if (function->memo) {
+                function->memo->store(memoArgs.data() + memoArgs.size() - function->nparams, value);
+                memoArgs.resize(memoArgs.size() - function->nparams);
+            }
+            Frame frame = frames.back();
+            frames.pop_back();
+            if ((int)frames.size() <= jitFloor)
+                jitFloor = INT_MAX;
+            function = frame.function;
+            code = &function->code[0];
+            pc = frame.pc;
+            base = frame.base;
+            R = stack.data() + base;
+            R[pc->a] = value;
+            ++pc;
+            VM_NEXT();
+        }
+        VM_CASE(PRINT)
+            *out << R[pc->a] << '\n';
+            ++pc;
+            VM_NEXT();
+        VM_CASE(DEFUN)
+            if (bindings[pc->a] < 0)
+                bindings[pc->a] = pc->b;
+            ++pc;
+            VM_NEXT();
+        }
+    } catch (const StringException &e) {
+        *out << function->lines[pc - code] << ": " << e.msg << '\n';
+        return false;
+    }
+}
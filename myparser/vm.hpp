@@ -0,0 +1,47 @@
+#ifndef H_VM
+#define H_VM
+
+#include <vector>
+#include "interpreter.hpp"
+#include "bytecode.hpp"
+using namespace std;
+
+
+class JIT;
+class Tracer;
+class Stats;
+
+
+// Register machine running a compiled Module. The registers of all active
+// frames live in one contiguous stack; a callee's window starts at the
+// caller's argument registers, so arguments are passed without copying.
+class VM {
+private:
+    struct Frame {
+        FunctionCode *function;
+        Instruction *pc;                // the CALL to resume at
+        size_t base;                    // first register in the stack
+    };
+
+    Module *module;
+    vector<int> bindings;               // function bound to each name, -1 if undefined
+    vector<Frame> frames;
+    vector<MyObject> stack;
+    vector<MyObject> memoArgs;          // arguments of the memoized calls in progress
+    int maxDepth;
+    JIT *jit;                           // NULL when functions are never compiled
+    int jitFloor;                       // frames from which calls stay in the VM after compiled code gave up
+    Tracer *tracer;
+    Stats *stats;
+    ostream *out;
+
+    int link(const Instruction *pc) const;
+
+public:
+    VM(Module *module, int maxDepth, size_t memoSize, bool jit, bool jitDump, Tracer *tracer, Stats *stats, ostream *out);
+    ~VM();
+    bool run();
+};
+
+
+#endif /* H_VM */
@@ -1,15 +1,51 @@
 %{
 #include "common.hpp"
+#include "cache.hpp"
 #include "interpreter.hpp"
+#include "natives.hpp"
+#include "output.hpp"
+#include "parser.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+%}
 
-extern "C" {
-    extern int yylex(void);
-    void yyerror(const char *);
+%code requires {
+#ifndef YY_TYPEDEF_YY_SCANNER_T
+#define YY_TYPEDEF_YY_SCANNER_T
+typedef void *yyscan_t;
+#endif
 }
 
-extern int yylineno;
+%code {
+// The reentrant scanner generated from lex.l
+struct yy_buffer_state;
+int yylex(YYSTYPE *lval, yyscan_t scanner);
+int yylex_init_extra(Symbols *symbols, yyscan_t *scanner);
+int yylex_destroy(yyscan_t scanner);
+yy_buffer_state *yy_scan_buffer(char *base, size_t size, yyscan_t scanner);
+int yyget_lineno(yyscan_t scanner);
+void yyset_lineno(int lineno, yyscan_t scanner);
 
-%}
+void yyerror(yyscan_t scanner, Program *program, string *error, const char *msg);
+
+// A call to one of the natives behind the array syntax
+static Expression *nativeCall(Program *program, const char *name, const vector<Expression *> &args) {
+    return new Call(program->symbols.name(program->symbols.intern(name, strlen(name))), args);
+}
+}
+
+%define api.pure full
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {Program *program} {string *error}
 
 %nonassoc IFX
 %nonassoc ELSE
@@ -23,6 +59,8 @@ extern int yylineno;
 %token SEMICOLON
 %token LBRACK RBRACK
 %token LPAREN RPAREN
+%token LSQUARE RSQUARE
+%token COLON
 %token EQUALS
 %token END
 %token FUNCTION RETURN
@@ -31,10 +69,13 @@ extern int yylineno;
 %token GT LT
 %token AND OR
 
+// Below every operator, so that ==, >= and <= keep shifting whatever follows
+%nonassoc COMPARE
 %left AND OR
 %left GT LT
 %left PLUS MINUS
 %left TIMES DIVIDE
+%left LSQUARE
 
 %type<stmts>statements
 %type<stmt>statement
@@ -42,24 +83,23 @@ extern int yylineno;
 %type<argNames>arg_names
 %type<argValues>arg_values
 
+// Lists still on the stack when a syntax error unwinds it
+%destructor { delete $$; } <stmts> <argNames> <argValues>
+
 %%
 
 program: statements
                                             {
-                                                cout << endl;
-                                                Interpreter &interpreter = getInterpreter();
-                                                for (vector<Statement *>::iterator iter = $1.begin(); iter != $1.end(); iter++) {
-                                                    interpreter.pushCode(*iter);
-                                                }
-                                                interpreter.run();
+                                                program->statements.swap(*$1);
+                                                delete $1;
                                             }
                     ;
 
 expression : LITERAL                        {
-                                                $$ = new Literal(*($1));
+                                                $$ = new Literal($1);
                                             }
            | NAME                           {
-                                                $$ = new Variable($1);
+                                                $$ = new Variable(program->symbols.name($1));
                                             }
            | LPAREN expression RPAREN
                                             {
@@ -89,15 +129,15 @@ expression : LITERAL                        {
                                             {
                                                 $$ = new LessThan(*($1), *($3));
                                             }
-           | expression GT EQUALS expression
+           | expression GT EQUALS expression %prec COMPARE
                                             {
                                                 $$ = new GreaterEqual(*($1), *($4));
                                             }
-           | expression LT EQUALS expression
+           | expression LT EQUALS expression %prec COMPARE
                                             {
                                                 $$ = new LessEqual(*($1), *($4));
                                             }
-           | expression EQUALS EQUALS expression
+           | expression EQUALS EQUALS expression %prec COMPARE
                                             {
                                                 $$ = new Equal(*($1), *($4));
                                             }
@@ -111,129 +151,425 @@ expression : LITERAL                        {
                                             }
            | NAME LPAREN arg_values RPAREN
                                             {
-                                                $$ = new Call($1, $3);
+                                                $$ = new Call(program->symbols.name($1), *$3);
+                                                delete $3;
+                                            }
+           | LSQUARE RSQUARE
+                                            {
+                                                $$ = nativeCall(program, NATIVE_ARRAY, vector<Expression *>());
+                                            }
+           | LSQUARE arg_values RSQUARE
+                                            {
+                                                $$ = nativeCall(program, NATIVE_ARRAY, *$2);
+                                                delete $2;
+                                            }
+           | expression LSQUARE expression RSQUARE
+                                            {
+                                                Expression *args[] = {$1, $3};
+                                                $$ = nativeCall(program, NATIVE_INDEX, vector<Expression *>(args, args + 2));
+                                            }
+           | expression LSQUARE expression COLON expression RSQUARE
+                                            {
+                                                Expression *args[] = {$1, $3, $5};
+                                                $$ = nativeCall(program, NATIVE_SLICE, vector<Expression *>(args, args + 3));
+                                            }
+           | expression LSQUARE expression COLON RSQUARE
+                                            {
+                                                Expression *args[] = {$1, $3, new Literal(INT_MAX)};
+                                                $$ = nativeCall(program, NATIVE_SLICE, vector<Expression *>(args, args + 3));
+                                            }
+           | expression LSQUARE COLON expression RSQUARE
+                                            {
+                                                Expression *args[] = {$1, new Literal(0), $4};
+                                                $$ = nativeCall(program, NATIVE_SLICE, vector<Expression *>(args, args + 3));
                                             }
            ;
 
 arg_names : NAME                            {
-                                                $$.push_back($1);
+                                                $$ = new vector<string>(1, program->symbols.name($1));
                                             }
           | arg_names COMMA NAME
                                             {
                                                 $$ = $1;
-                                                $$.push_back($3);
+                                                $$->push_back(program->symbols.name($3));
                                             }
 
 arg_values : expression                     {
-                                                $$.push_back($1);
+                                                $$ = new vector<Expression *>(1, $1);
                                             }
            | arg_values COMMA expression    {
                                                 $$ = $1;
-                                                $$.push_back($3);
+                                                $$->push_back($3);
                                             }
 
 statement : NAME EQUALS expression SEMICOLON
                                             {
-                                                $$ = new Assignment($1, $3);
-                                                $$->setLineno(yylineno);
+                                                $$ = new Assignment(program->symbols.name($1), $3);
+                                                $$->setLineno(yyget_lineno(scanner));
                                             }
           | PRINT expression SEMICOLON
                                             {
                                                 $$ = new Print($2);
-                                                $$->setLineno(yylineno);
+                                                $$->setLineno(yyget_lineno(scanner));
                                             }
           | FUNCTION NAME LPAREN arg_names RPAREN LBRACK statements RBRACK
                                             {
-                                                $$ = new Function($2, $4, $7);
-                                                $7.clear();             // Because this variable will be reused
-                                                $$->setLineno(yylineno);
+                                                $$ = new Function(program->symbols.name($2), *$4, *$7);
+                                                delete $4;
+                                                delete $7;
+                                                $$->setLineno(yyget_lineno(scanner));
                                             }
           | RETURN expression SEMICOLON
                                             {
                                                 $$ = new Return($2);
-                                                $$->setLineno(yylineno);
+                                                $$->setLineno(yyget_lineno(scanner));
                                             }
           ;
 
-statements :                                ;
+statements :                                {
+                                                $$ = new vector<Statement *>();
+                                            }
            | statements IF LPAREN expression RPAREN LBRACK statements RBRACK
                                             {
                                                 $$ = $1;
                                                 Expression *condition = $4;
-                                                vector<Statement *> &stmts = $7;
+                                                vector<Statement *> &stmts = *$7;
                                                 int skiprows = stmts.size();
                                                 If *if_stmt = new If(condition, skiprows);
-                                                if_stmt->setLineno(yylineno - skiprows);
-                                                $$.push_back(if_stmt);
-                                                $$.insert($$.end(), stmts.begin(), stmts.end());
+                                                if_stmt->setLineno(yyget_lineno(scanner) - skiprows);
+                                                $$->push_back(if_stmt);
+                                                $$->insert($$->end(), stmts.begin(), stmts.end());
 
-                                                stmts.clear();
+                                                delete $7;
                                             }
            | statements IF LPAREN expression RPAREN LBRACK statements RBRACK ELSE LBRACK statements RBRACK
                                             {
                                                 $$ = $1;
                                                 Expression *condition = $4;
-                                                vector<Statement *> &if_stmts = $7, else_stmts = $11;
+                                                vector<Statement *> &if_stmts = *$7, &else_stmts = *$11;
                                                 int if_skiprows = if_stmts.size(), else_skiprows = else_stmts.size();
                                                 Statement *if_stmt = new If(condition, if_skiprows + 1);
-                                                if_stmt->setLineno(yylineno - if_skiprows - else_skiprows - 1);
-                                                $$.push_back(if_stmt);
+                                                if_stmt->setLineno(yyget_lineno(scanner) - if_skiprows - else_skiprows - 1);
+                                                $$->push_back(if_stmt);
 
-                                                $$.insert($$.end(), if_stmts.begin(), if_stmts.end());
+                                                $$->insert($$->end(), if_stmts.begin(), if_stmts.end());
 
-                                                Statement *else_stmt = new If(new Literal(1), else_skiprows);
-                                                else_stmt->setLineno(yylineno - else_skiprows);
-                                                $$.push_back(else_stmt);
+                                                Statement *else_stmt = new If(new Literal(0), else_skiprows);
+                                                else_stmt->setLineno(yyget_lineno(scanner) - else_skiprows);
+                                                $$->push_back(else_stmt);
 
-                                                $$.insert($$.end(), else_stmts.begin(), else_stmts.end());
+                                                $$->insert($$->end(), else_stmts.begin(), else_stmts.end());
 
-                                                if_stmts.clear();
-                                                else_stmts.clear();
+                                                delete $7;
+                                                delete $11;
                                             }
            | statements WHILE LPAREN expression RPAREN LBRACK statements RBRACK
                                             {
                                                 $$ = $1;
                                                 Expression *condition = $4;
-                                                vector<Statement *> stmts = $7;
+                                                vector<Statement *> &stmts = *$7;
                                                 int skiprows = stmts.size() + 1;
                                                 If *if_stmt = new If(condition, skiprows);
-                                                if_stmt->setLineno(yylineno - stmts.size());
-                                                $$.push_back(if_stmt);
+                                                if_stmt->setLineno(yyget_lineno(scanner) - stmts.size());
+                                                $$->push_back(if_stmt);
 
-                                                $$.insert($$.end(), stmts.begin(), stmts.end());
+                                                $$->insert($$->end(), stmts.begin(), stmts.end());
 
                                                 Statement *loop = new If(new Literal(0), -skiprows - 1);
-                                                loop->setLineno(yylineno);
-                                                $$.push_back(loop);
+                                                loop->setLineno(yyget_lineno(scanner));
+                                                $$->push_back(loop);
 
-                                                stmts.clear();
+                                                delete $7;
                                             }
            | statements statement
                                             {
                                                 $$ = $1;
-                                                $$.push_back($2);
+                                                $$->push_back($2);
                                             }
             ;
 
-
 %%
 
-void yyerror(const char *s) {
-    cout << "ParseError: " << s << endl;
+// Kept for parse() to throw once the parser has returned and cleaned up
+void yyerror(yyscan_t scanner, Program *program, string *error, const char *msg) {
+    stringstream ss;
+    ss << yyget_lineno(scanner) << ": ParseError: " << msg;
+    *error = ss.str();
+}
+
+
+Program *parseBuffer(char *buffer, size_t size) {
+    Program *program = new Program();
+    yyscan_t scanner;
+    if (yylex_init_extra(&program->symbols, &scanner) != 0) {
+        delete program;
+        throw StringException("Can't create the scanner");
+    }
+    yy_scan_buffer(buffer, size + 2, scanner);
+    yyset_lineno(1, scanner);
+    string error;
+    int failed;
+    {
+        Arena::Scope scope(&program->arena);
+        failed = yyparse(scanner, program, &error);
+    }
+    yylex_destroy(scanner);
+    if (failed) {
+        delete program;
+        throw StringException(error.empty() ? "ParseError: out of memory" : error);
+    }
+    return program;
+}
+
+
+Program *parseSource(const string &source) {
+    vector<char> buffer(source.begin(), source.end());
+    buffer.resize(source.size() + 2, '\0');
+    return parseBuffer(buffer.data(), source.size());
+}
+
+
+Program *parseFile(const string &path) {
+    SourceFile source(path);
+    return parseBuffer(source.getData(), source.getSize());
+}
+
+
+SourceFile::SourceFile(const string &path) : data(NULL), size(0), mapped(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        throw StringException("Can't open file");
+    }
+    size = st.st_size;
+    // Zeroed anonymous pages make room for the NULs, and the file is mapped over their start
+    size_t page = sysconf(_SC_PAGESIZE);
+    mapped = (size + 2 + page - 1) / page * page;
+    void *base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED && size > 0
+            && mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapped);
+        base = MAP_FAILED;
+    }
+    close(fd);
+    if (base == MAP_FAILED)
+        throw StringException("Can't open file");
+    data = (char *)base;
+}
+
+
+SourceFile::~SourceFile() {
+    munmap(data, mapped);
+}
+
+
+char *SourceFile::getData() const {
+    return data;
+}
+
+
+size_t SourceFile::getSize() const {
+    return size;
 }
 
 void printHelp() {
-    cout << "my script.my" << endl;
+    cout << "my [options] [script.my ...]    (default myparser/test.my)" << endl;
+    cout << "  --cache             load the parsed script from script.myc when it matches the source, or write it there" << endl;
+    cout << "  --jobs N            run the scripts on N threads, printing the output of each in the order given" << endl;
+    cout << "  --output FILE       write what the scripts print to FILE instead of stdout" << endl;
+    cout << "  --output-thread     write the output on a thread of its own while the scripts go on" << endl;
+    cout << "  --engine=vm|tree|closure" << endl;
+    cout << "                      run compiled bytecode (default), walk the statements, or run them as specialized closures" << endl;
+    cout << "  --max-depth=N       nested calls allowed before a stack overflow (default " << DEFAULT_MAX_DEPTH << ")" << endl;
+    cout << "  --no-tail-calls     give `return f(...)` its own frame, keeping every caller on the stack" << endl;
+    cout << "  --memo[=N]          cache up to N results (default " << DEFAULT_MEMO_SIZE << ") of every pure function" << endl;
+    cout << "  --memo-stats        like --memo, and print hits and misses per function on exit" << endl;
+    cout << "  --jit, --no-jit     compile hot pure functions to x86-64 code on the vm engine (default on)" << endl;
+    cout << "  --jit-dump          print the machine code of every compiled function" << endl;
+    cout << "  --bench             print parse and run time, statements, calls and peak RSS as JSON on exit" << endl;
+    cout << "  --stats[=json]      print statements, calls, call cache, frame, lookup and memory counters on exit" << endl;
+    cout << "  --profile[=FILE]    run on the tree engine and report statements per line and time per function on exit," << endl;
+    cout << "                      writing folded call stacks for flamegraph.pl to FILE (default " << DEFAULT_PROFILE_PATH << ")" << endl;
+    cout << "  --trace=KINDS       trace stmt (tree engine), call and/or code (bytecode), comma separated, or all" << endl;
+    cout << "  --trace-file=FILE   write the trace to FILE instead of stderr" << endl;
+    cout << "  --trace-ring=N      keep only the last N trace events, written on exit" << endl;
+    cout << "  -O0, -O1            disable or enable constant folding before running (default -O" << DEFAULT_OPT_LEVEL << ")" << endl;
+}
+
+
+// Applies one command line option, false if there is no such option
+static bool configure(Interpreter &interpreter, const string &arg) {
+    if (arg == "--engine=vm") {
+        interpreter.setEngine(ENGINE_VM);
+    } else if (arg == "--engine=tree") {
+        interpreter.setEngine(ENGINE_TREE);
+    } else if (arg == "--engine=closure") {
+        interpreter.setEngine(ENGINE_CLOSURE);
+    } else if (arg == "--no-tail-calls") {
+        interpreter.setTailCalls(false);
+    } else if (arg == "--memo") {
+        interpreter.setMemoSize(DEFAULT_MEMO_SIZE);
+    } else if (arg.compare(0, 7, "--memo=") == 0) {
+        interpreter.setMemoSize(atoi(arg.c_str() + 7));
+    } else if (arg == "--memo-stats") {
+        interpreter.setMemoStats(true);
+    } else if (arg == "--jit") {
+        interpreter.setJit(true);
+    } else if (arg == "--no-jit") {
+        interpreter.setJit(false);
+    } else if (arg == "--jit-dump") {
+        interpreter.setJitDump(true);
+    } else if (arg == "--profile") {
+        interpreter.setProfile(DEFAULT_PROFILE_PATH);
+    } else if (arg.compare(0, 10, "--profile=") == 0) {
+        interpreter.setProfile(arg.substr(10));
+    } else if (arg.compare(0, 8, "--trace=") == 0) {
+        return interpreter.getTracer().setKinds(arg.substr(8));
+    } else if (arg.compare(0, 13, "--trace-file=") == 0) {
+        if (!interpreter.getTracer().setFile(arg.substr(13)))
+            throw StringException("Can't open file");
+    } else if (arg.compare(0, 13, "--trace-ring=") == 0) {
+        interpreter.getTracer().setRing(atoi(arg.c_str() + 13));
+    } else if (arg == "--bench") {
+        interpreter.setBench(true);
+    } else if (arg == "--stats") {
+        interpreter.setStats(STATS_TEXT);
+    } else if (arg == "--stats=json") {
+        interpreter.setStats(STATS_JSON);
+    } else if (arg == "-O0") {
+        interpreter.setOptLevel(0);
+    } else if (arg == "-O1") {
+        interpreter.setOptLevel(1);
+    } else if (arg.compare(0, 12, "--max-depth=") == 0) {
+        interpreter.setMaxDepth(atoi(arg.c_str() + 12));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+// Parses and runs one script on an interpreter of its own, which prints to
+// out and reports to err. False when it failed to parse or stopped on an error.
+static bool runScript(const string &path, const vector<string> &options, bool cache, ostream &out, ostream &err) {
+    Interpreter interpreter;
+    interpreter.setOutput(&out, &err);
+    Program *program;
+    try {
+        for (vector<string>::const_iterator iter = options.begin(); iter != options.end(); iter++) {
+            configure(interpreter, *iter);
+        }
+        program = cache ? loadProgram(path) : parseFile(path);
+    } catch (const StringException &e) {
+        out << e.msg << '\n';
+        return false;
+    }
+    out << '\n';
+    interpreter.load(program);
+    // The nodes name their variables and functions through its symbols
+    bool ok = interpreter.run();
+    delete program;
+    return ok;
+}
+
+
+// Runs the scripts on a pool of threads. Each one prints into buffers of its
+// own, written out in the order the scripts were given once all have finished.
+static bool runBatch(const vector<string> &paths, const vector<string> &options, bool cache, int jobs, ostream &out) {
+    vector<stringstream> outs(paths.size()), errs(paths.size());
+    vector<char> succeeded(paths.size(), 0);
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int i = 0; i < jobs && i < (int)paths.size(); i++) {
+        workers.push_back(thread([&]() {
+            for (size_t job = next++; job < paths.size(); job = next++) {
+                succeeded[job] = runScript(paths[job], options, cache, outs[job], errs[job]);
+            }
+        }));
+    }
+    for (vector<thread>::iterator iter = workers.begin(); iter != workers.end(); iter++) {
+        iter->join();
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < paths.size(); i++) {
+        // Each script's reports follow its output, as with a single script
+        out << outs[i].str();
+        out.flush();
+        cerr << errs[i].str();
+        ok = ok && succeeded[i];
+    }
+    return ok;
 }
 
 
 int main(int args, char **argv) {
-    extern FILE *yyin;
-    FILE *fp = fopen("myparser/test.my", "r");
-    if (fp == NULL) {
+    vector<string> options, paths;
+    int jobs = 0;
+    bool cache = false;
+    string outputPath;
+    bool outputThread = false;
+    for (int i = 1; i < args; i++) {
+        string arg = argv[i];
+        if (arg == "--cache") {
+            cache = true;
+        } else if (arg == "--jobs" && i + 1 < args) {
+            jobs = atoi(argv[++i]);
+        } else if (arg.compare(0, 7, "--jobs=") == 0) {
+            jobs = atoi(arg.c_str() + 7);
+        } else if (arg == "--output" && i + 1 < args) {
+            outputPath = argv[++i];
+        } else if (arg.compare(0, 9, "--output=") == 0) {
+            outputPath = arg.substr(9);
+        } else if (arg == "--output-thread") {
+            outputThread = true;
+        } else if (arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            options.push_back(arg);
+        }
+    }
+
+    if (paths.empty())
+        paths.push_back("myparser/test.my");
+    bool batch = paths.size() > 1 || jobs > 0;
+
+    // Every option is checked once up front, not by each script. Those that
+    // write a file would have every script of a batch truncate it in turn.
+    Interpreter defaults;
+    try {
+        for (vector<string>::iterator iter = options.begin(); iter != options.end(); iter++) {
+            if (batch && (iter->compare(0, 9, "--profile") == 0 || iter->compare(0, 13, "--trace-file=") == 0)) {
+                cout << *iter << " takes a single script" << endl;
+                exit(-1);
+            }
+            if (!configure(defaults, *iter)) {
+                printHelp();
+                exit(-1);
+            }
+        }
+    } catch (const StringException &e) {
+        cout << e.msg << endl;
+        exit(-1);
+    }
+
+    // What the scripts print is written out when the buffer fills up and on exit
+    OutputBuffer *buffer;
+    if (outputPath.empty()) {
+        buffer = new OutputBuffer(STDOUT_FILENO, false, outputThread);
+    } else if (!(buffer = OutputBuffer::open(outputPath, outputThread))) {
         cout << "Can't open file" << endl;
         exit(-1);
     }
-    yyin = fp;
-    yyparse();
-}
\ No newline at end of file
+    ostream out(buffer);
+
+    bool ok;
+    if (!batch)
+        ok = runScript(paths[0], options, cache, out, cerr);
+    else
+        ok = runBatch(paths, options, cache, max(jobs, 1), out);
+    delete buffer;
+    return ok ? 0 : -1;
+}
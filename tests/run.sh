@@ -0,0 +1,23 @@
+#!/bin/sh
+# Runs every tests/*.my script on each engine and compares its output with the
+# .expected file next to it. The exit status is the number of failures.
+# usage: tests/run.sh [interpreter] [interpreter options...]
+
+TESTS_DIR=$(dirname "$0")
+EXE=${1:-build/run}
+[ $# -gt 0 ] && shift
+OPTIONS="$*"
+
+failures=0
+for script in "$TESTS_DIR"/*.my; do
+    name=$(basename "$script" .my)
+    for engine in "--engine=vm" "--engine=vm --no-jit" "--engine=tree" "--engine=closure" "-O0"; do
+        if "$EXE" $engine $OPTIONS "$script" 2>/dev/null | cmp -s - "$TESTS_DIR/$name.expected"; then
+            echo "ok   $name $engine" >&2
+        else
+            echo "FAIL $name $engine" >&2
+            failures=$((failures + 1))
+        fi
+    done
+done
+exit $failures